@@ -1,5 +1,4 @@
 #define _GNU_SOURCE
-#include <math.h>
 #include <openssl/md5.h>
 #include <pthread.h>
 #include <stdint.h>
@@ -14,13 +13,268 @@
 // global variable to track the number of cracked passwords
 int crack_cnt = 0;
 
+/************************* MD5 engine *************************/
+
+// Every candidate is PASSWORD_LENGTH bytes, so each fits in one 64-byte MD5 block. Only the first
+// two words of the block hold candidate bytes. The rest are the 0x80 padding byte, zeros, and the
+// message length in bits, which are the same for every candidate and are written into the steps
+// below as constants. md5_word1 assumes there are exactly six.
+_Static_assert(PASSWORD_LENGTH == 6, "the MD5 engine hashes six-character candidates");
+
+// The number of candidates md5_batch hashes at once: one per 32-bit lane of an AVX-512 register
+#define MD5_BATCH 16
+
+// The MD5 round functions, and one step of the compression function. These work on plain
+// uint32_t values and on vectors of them, so every engine below shares them.
+#define MD5_F(b, c, d) ((d) ^ ((b) & ((c) ^ (d))))
+#define MD5_G(b, c, d) ((c) ^ ((d) & ((b) ^ (c))))
+#define MD5_H(b, c, d) ((b) ^ (c) ^ (d))
+#define MD5_I(b, c, d) ((c) ^ ((b) | ~(d)))
+#define MD5_ROTL(x, s) (((x) << (s)) | ((x) >> (32 - (s))))
+#define MD5_STEP(f, a, b, c, d, x, k, s) \
+  a += f(b, c, d) + (x) + (k);           \
+  a = MD5_ROTL(a, s) + (b)
+
+// The initial MD5 state
+#define MD5_A 0x67452301
+#define MD5_B 0xefcdab89
+#define MD5_C 0x98badcfe
+#define MD5_D 0x10325476
+
+// Run all 64 steps on a state that starts as MD5_A, MD5_B, MD5_C, and MD5_D. x0 and x1 are the
+// first two words of the block.
+#define MD5_BLOCK(a, b, c, d, x0, x1)                                                             \
+  MD5_STEP(MD5_F, a, b, c, d, x0, 0xd76aa478, 7);                                                 \
+  MD5_STEP(MD5_F, d, a, b, c, x1, 0xe8c7b756, 12);                                                \
+  MD5_STEP(MD5_F, c, d, a, b, 0, 0x242070db, 17);                                                 \
+  MD5_STEP(MD5_F, b, c, d, a, 0, 0xc1bdceee, 22);                                                 \
+  MD5_STEP(MD5_F, a, b, c, d, 0, 0xf57c0faf, 7);                                                  \
+  MD5_STEP(MD5_F, d, a, b, c, 0, 0x4787c62a, 12);                                                 \
+  MD5_STEP(MD5_F, c, d, a, b, 0, 0xa8304613, 17);                                                 \
+  MD5_STEP(MD5_F, b, c, d, a, 0, 0xfd469501, 22);                                                 \
+  MD5_STEP(MD5_F, a, b, c, d, 0, 0x698098d8, 7);                                                  \
+  MD5_STEP(MD5_F, d, a, b, c, 0, 0x8b44f7af, 12);                                                 \
+  MD5_STEP(MD5_F, c, d, a, b, 0, 0xffff5bb1, 17);                                                 \
+  MD5_STEP(MD5_F, b, c, d, a, 0, 0x895cd7be, 22);                                                 \
+  MD5_STEP(MD5_F, a, b, c, d, 0, 0x6b901122, 7);                                                  \
+  MD5_STEP(MD5_F, d, a, b, c, 0, 0xfd987193, 12);                                                 \
+  MD5_STEP(MD5_F, c, d, a, b, PASSWORD_LENGTH * 8, 0xa679438e, 17);                               \
+  MD5_STEP(MD5_F, b, c, d, a, 0, 0x49b40821, 22);                                                 \
+  MD5_STEP(MD5_G, a, b, c, d, x1, 0xf61e2562, 5);                                                 \
+  MD5_STEP(MD5_G, d, a, b, c, 0, 0xc040b340, 9);                                                  \
+  MD5_STEP(MD5_G, c, d, a, b, 0, 0x265e5a51, 14);                                                 \
+  MD5_STEP(MD5_G, b, c, d, a, x0, 0xe9b6c7aa, 20);                                                \
+  MD5_STEP(MD5_G, a, b, c, d, 0, 0xd62f105d, 5);                                                  \
+  MD5_STEP(MD5_G, d, a, b, c, 0, 0x02441453, 9);                                                  \
+  MD5_STEP(MD5_G, c, d, a, b, 0, 0xd8a1e681, 14);                                                 \
+  MD5_STEP(MD5_G, b, c, d, a, 0, 0xe7d3fbc8, 20);                                                 \
+  MD5_STEP(MD5_G, a, b, c, d, 0, 0x21e1cde6, 5);                                                  \
+  MD5_STEP(MD5_G, d, a, b, c, PASSWORD_LENGTH * 8, 0xc33707d6, 9);                                \
+  MD5_STEP(MD5_G, c, d, a, b, 0, 0xf4d50d87, 14);                                                 \
+  MD5_STEP(MD5_G, b, c, d, a, 0, 0x455a14ed, 20);                                                 \
+  MD5_STEP(MD5_G, a, b, c, d, 0, 0xa9e3e905, 5);                                                  \
+  MD5_STEP(MD5_G, d, a, b, c, 0, 0xfcefa3f8, 9);                                                  \
+  MD5_STEP(MD5_G, c, d, a, b, 0, 0x676f02d9, 14);                                                 \
+  MD5_STEP(MD5_G, b, c, d, a, 0, 0x8d2a4c8a, 20);                                                 \
+  MD5_STEP(MD5_H, a, b, c, d, 0, 0xfffa3942, 4);                                                  \
+  MD5_STEP(MD5_H, d, a, b, c, 0, 0x8771f681, 11);                                                 \
+  MD5_STEP(MD5_H, c, d, a, b, 0, 0x6d9d6122, 16);                                                 \
+  MD5_STEP(MD5_H, b, c, d, a, PASSWORD_LENGTH * 8, 0xfde5380c, 23);                               \
+  MD5_STEP(MD5_H, a, b, c, d, x1, 0xa4beea44, 4);                                                 \
+  MD5_STEP(MD5_H, d, a, b, c, 0, 0x4bdecfa9, 11);                                                 \
+  MD5_STEP(MD5_H, c, d, a, b, 0, 0xf6bb4b60, 16);                                                 \
+  MD5_STEP(MD5_H, b, c, d, a, 0, 0xbebfbc70, 23);                                                 \
+  MD5_STEP(MD5_H, a, b, c, d, 0, 0x289b7ec6, 4);                                                  \
+  MD5_STEP(MD5_H, d, a, b, c, x0, 0xeaa127fa, 11);                                                \
+  MD5_STEP(MD5_H, c, d, a, b, 0, 0xd4ef3085, 16);                                                 \
+  MD5_STEP(MD5_H, b, c, d, a, 0, 0x04881d05, 23);                                                 \
+  MD5_STEP(MD5_H, a, b, c, d, 0, 0xd9d4d039, 4);                                                  \
+  MD5_STEP(MD5_H, d, a, b, c, 0, 0xe6db99e5, 11);                                                 \
+  MD5_STEP(MD5_H, c, d, a, b, 0, 0x1fa27cf8, 16);                                                 \
+  MD5_STEP(MD5_H, b, c, d, a, 0, 0xc4ac5665, 23);                                                 \
+  MD5_STEP(MD5_I, a, b, c, d, x0, 0xf4292244, 6);                                                 \
+  MD5_STEP(MD5_I, d, a, b, c, 0, 0x432aff97, 10);                                                 \
+  MD5_STEP(MD5_I, c, d, a, b, PASSWORD_LENGTH * 8, 0xab9423a7, 15);                               \
+  MD5_STEP(MD5_I, b, c, d, a, 0, 0xfc93a039, 21);                                                 \
+  MD5_STEP(MD5_I, a, b, c, d, 0, 0x655b59c3, 6);                                                  \
+  MD5_STEP(MD5_I, d, a, b, c, 0, 0x8f0ccc92, 10);                                                 \
+  MD5_STEP(MD5_I, c, d, a, b, 0, 0xffeff47d, 15);                                                 \
+  MD5_STEP(MD5_I, b, c, d, a, x1, 0x85845dd1, 21);                                                \
+  MD5_STEP(MD5_I, a, b, c, d, 0, 0x6fa87e4f, 6);                                                  \
+  MD5_STEP(MD5_I, d, a, b, c, 0, 0xfe2ce6e0, 10);                                                 \
+  MD5_STEP(MD5_I, c, d, a, b, 0, 0xa3014314, 15);                                                 \
+  MD5_STEP(MD5_I, b, c, d, a, 0, 0x4e0811a1, 21);                                                 \
+  MD5_STEP(MD5_I, a, b, c, d, 0, 0xf7537e82, 6);                                                  \
+  MD5_STEP(MD5_I, d, a, b, c, 0, 0xbd3af235, 10);                                                 \
+  MD5_STEP(MD5_I, c, d, a, b, 0, 0x2ad7d2bb, 15);                                                 \
+  MD5_STEP(MD5_I, b, c, d, a, 0, 0xeb86d391, 21)
+
+/**
+ * Get the first word of a candidate's MD5 block. MD5 reads words little-endian.
+ *
+ * \param candidate  PASSWORD_LENGTH characters
+ * \returns the word
+ */
+static inline uint32_t md5_word0(const char* candidate) {
+  const uint8_t* bytes = (const uint8_t*)candidate;
+  return bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+/**
+ * Get the second word of a candidate's MD5 block: its last two characters and the padding byte.
+ *
+ * \param candidate  PASSWORD_LENGTH characters
+ * \returns the word
+ */
+static inline uint32_t md5_word1(const char* candidate) {
+  const uint8_t* bytes = (const uint8_t*)candidate;
+  return bytes[4] | bytes[5] << 8 | 0x80 << 16;
+}
+
+/**
+ * Write out a digest from the final state words of one candidate.
+ *
+ * \param digest      Space for MD5_DIGEST_LENGTH bytes
+ * \param a, b, c, d  The state after MD5_BLOCK, before the initial state is added back
+ */
+static inline void md5_store(uint8_t* digest, uint32_t a, uint32_t b, uint32_t c, uint32_t d) {
+  uint32_t words[4] = {a + MD5_A, b + MD5_B, c + MD5_C, d + MD5_D};
+  for (int i = 0; i < 4; i++) {
+    digest[i * 4] = words[i];
+    digest[i * 4 + 1] = words[i] >> 8;
+    digest[i * 4 + 2] = words[i] >> 16;
+    digest[i * 4 + 3] = words[i] >> 24;
+  }
+}
+
+/**
+ * Hash a batch of candidates one at a time. This runs on any CPU.
+ *
+ * \param candidates  MD5_BATCH candidates of PASSWORD_LENGTH characters, with no terminators
+ * \param digests     The MD5 hash of each candidate is written here
+ */
+void md5_batch_scalar(const char (*candidates)[PASSWORD_LENGTH],
+                      uint8_t (*digests)[MD5_DIGEST_LENGTH]) {
+  for (int i = 0; i < MD5_BATCH; i++) {
+    uint32_t x0 = md5_word0(candidates[i]);
+    uint32_t x1 = md5_word1(candidates[i]);
+    uint32_t a = MD5_A, b = MD5_B, c = MD5_C, d = MD5_D;
+    MD5_BLOCK(a, b, c, d, x0, x1);
+    md5_store(digests[i], a, b, c, d);
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// Vectors of MD5 state words, one candidate per lane
+typedef uint32_t md5x8_t __attribute__((vector_size(32)));
+typedef uint32_t md5x16_t __attribute__((vector_size(64)));
+
+/**
+ * Hash a batch of candidates eight at a time with AVX2.
+ *
+ * \param candidates  MD5_BATCH candidates of PASSWORD_LENGTH characters, with no terminators
+ * \param digests     The MD5 hash of each candidate is written here
+ */
+__attribute__((target("avx2"))) void md5_batch_avx2(const char (*candidates)[PASSWORD_LENGTH],
+                                                    uint8_t (*digests)[MD5_DIGEST_LENGTH]) {
+  for (int start = 0; start < MD5_BATCH; start += 8) {
+    md5x8_t x0, x1;
+    for (int i = 0; i < 8; i++) {
+      x0[i] = md5_word0(candidates[start + i]);
+      x1[i] = md5_word1(candidates[start + i]);
+    }
+    md5x8_t zero = {0};
+    md5x8_t a = zero + MD5_A, b = zero + MD5_B, c = zero + MD5_C, d = zero + MD5_D;
+    MD5_BLOCK(a, b, c, d, x0, x1);
+    for (int i = 0; i < 8; i++) {
+      md5_store(digests[start + i], a[i], b[i], c[i], d[i]);
+    }
+  }
+}
+
+/**
+ * Hash a batch of candidates sixteen at a time with AVX-512.
+ *
+ * \param candidates  MD5_BATCH candidates of PASSWORD_LENGTH characters, with no terminators
+ * \param digests     The MD5 hash of each candidate is written here
+ */
+__attribute__((target("avx512f"))) void md5_batch_avx512(const char (*candidates)[PASSWORD_LENGTH],
+                                                         uint8_t (*digests)[MD5_DIGEST_LENGTH]) {
+  md5x16_t x0, x1;
+  for (int i = 0; i < 16; i++) {
+    x0[i] = md5_word0(candidates[i]);
+    x1[i] = md5_word1(candidates[i]);
+  }
+  md5x16_t zero = {0};
+  md5x16_t a = zero + MD5_A, b = zero + MD5_B, c = zero + MD5_C, d = zero + MD5_D;
+  MD5_BLOCK(a, b, c, d, x0, x1);
+  for (int i = 0; i < 16; i++) {
+    md5_store(digests[i], a[i], b[i], c[i], d[i]);
+  }
+}
+
+#endif
+
+/// Hashes MD5_BATCH candidates at once with the widest engine this CPU has. Set by md5_init.
+void (*md5_batch)(const char (*candidates)[PASSWORD_LENGTH],
+                  uint8_t (*digests)[MD5_DIGEST_LENGTH]) = md5_batch_scalar;
+
+/**
+ * Pick the MD5 engine for this CPU. Until this is called md5_batch uses the scalar engine.
+ */
+void md5_init() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    md5_batch = md5_batch_avx512;
+  } else if (__builtin_cpu_supports("avx2")) {
+    md5_batch = md5_batch_avx2;
+  }
+#endif
+}
+
 /************************* Part A *************************/
-// It changes the input num to 26-based number to be added to "aaaaaa"
-void conversion_helpler(int num, int* arr) {
-  int val = 0;
+// The number of candidate passwords: every lower-case string of PASSWORD_LENGTH characters
+int num_candidates() {
+  int count = 1;
   for (int i = 0; i < PASSWORD_LENGTH; i++) {
-    arr[i] = (num - val) / pow(26, (PASSWORD_LENGTH - 1 - i));
-    val += arr[i] * pow(26, (PASSWORD_LENGTH - 1 - i));
+    count *= 26;
+  }
+  return count;
+}
+
+// Write the candidate with a given number into candidate, with no terminator. Candidates are
+// numbered in base 26 with 'a' as the zero digit, so 0 is "aaaaaa" and 27 is "aaaabb".
+void candidate_at(int num, char* candidate) {
+  for (int j = PASSWORD_LENGTH - 1; j >= 0; j--) {
+    candidate[j] = 'a' + num % 26;
+    num /= 26;
+  }
+}
+
+// Step candidate to the next number like an odometer: bump the last character, and carry into
+// the one before it whenever a character wraps around from 'z' to 'a'
+void next_candidate(char* candidate) {
+  for (int j = PASSWORD_LENGTH - 1; j >= 0; j--) {
+    if (candidate[j] != 'z') {
+      candidate[j]++;
+      return;
+    }
+    candidate[j] = 'a';
+  }
+}
+
+// Fill a batch with count candidates in order starting from next, and step next past them. The
+// rest of the batch repeats the last of them, so the whole batch can still be hashed.
+void fill_batch(char (*candidates)[PASSWORD_LENGTH], char* next, int count) {
+  for (int k = 0; k < MD5_BATCH; k++) {
+    if (k < count) {
+      memcpy(candidates[k], next, PASSWORD_LENGTH);
+      next_candidate(next);
+    } else {
+      memcpy(candidates[k], candidates[count - 1], PASSWORD_LENGTH);
+    }
   }
 }
 
@@ -33,25 +287,27 @@ void conversion_helpler(int num, int* arr) {
  * \returns           0 if the password was cracked. -1 otherwise.
  */
 int crack_single_password(uint8_t* input_hash, char* output) {
-  for (int i = 0; i < (pow(26, PASSWORD_LENGTH)); i++) {
-    int arr_plus[PASSWORD_LENGTH] = {0};
-    conversion_helpler(i, arr_plus);
-    char candidate_passwd[] = "aaaaaa";  //< This variable holds the password we are trying
-    for (int j = 0; j < PASSWORD_LENGTH; j++) {
-      candidate_passwd[j] += arr_plus[j];
-    }
-    // Take our candidate password and hash it using MD5
-    uint8_t candidate_hash[MD5_DIGEST_LENGTH];  //< This holds the hash of the candidate password
-    MD5((unsigned char*)candidate_passwd, strlen(candidate_passwd), candidate_hash);
-
-    // Now check if the hash of the candidate password matches the input hash
-    if (memcmp(input_hash, candidate_hash, MD5_DIGEST_LENGTH) == 0) {
-      // Match! Copy the password to the output and return 0 (success)
-      strncpy(output, candidate_passwd, PASSWORD_LENGTH + 1);
-      return 0;
-    } else {
-      // No match. continue
-      continue;
+  int total = num_candidates();
+  char next[PASSWORD_LENGTH];  //< The next password to try
+  candidate_at(0, next);
+  for (int i = 0; i < total; i += MD5_BATCH) {
+    // Fill a batch with the next candidates
+    char candidates[MD5_BATCH][PASSWORD_LENGTH];  //< The passwords we are trying
+    int count = total - i < MD5_BATCH ? total - i : MD5_BATCH;
+    fill_batch(candidates, next, count);
+
+    // Take our candidate passwords and hash them all using MD5
+    uint8_t candidate_hashes[MD5_BATCH][MD5_DIGEST_LENGTH];  //< The hashes of the candidates
+    md5_batch(candidates, candidate_hashes);
+
+    // Now check if the hash of any candidate password matches the input hash
+    for (int k = 0; k < count; k++) {
+      if (memcmp(input_hash, candidate_hashes[k], MD5_DIGEST_LENGTH) == 0) {
+        // Match! Copy the password to the output and return 0 (success)
+        memcpy(output, candidates[k], PASSWORD_LENGTH);
+        output[PASSWORD_LENGTH] = '\0';
+        return 0;
+      }
     }
   }
   return -1;
@@ -125,31 +381,34 @@ void add_password(password_set_t* passwords, char* username, uint8_t* password_h
 void* mythread(void* arg) {
   thread_args* args = (thread_args*)arg;
 
-  for (int i = args->start; i <= args->end; i++) {
-    int arr_plus[PASSWORD_LENGTH] = {0};
-    conversion_helpler(i, arr_plus);
-    char candidate_passwd[] = "aaaaaa";  //< This variable holds the password we are trying
-    for (int j = 0; j < PASSWORD_LENGTH; j++) {
-      candidate_passwd[j] += arr_plus[j];
-    }
-    // Take our candidate password and hash it using MD5
-    uint8_t candidate_hash[MD5_DIGEST_LENGTH];  //< This holds the hash of the candidate password
-    MD5((unsigned char*)candidate_passwd, strlen(candidate_passwd), candidate_hash);
-
-    password_set_t* temp = args->candidates;
-    // use cur to traverse the whole list to see if there is a match
-    linked_list_t* cur = temp->header;
-
-    while (cur != NULL) {
-      // Now check if the hash of the candidate password matches the input hash
-      if (memcmp(cur->hash_password, candidate_hash, MD5_DIGEST_LENGTH) == 0) {
-        // Match! print it out and increase crack_cnt by 1
-        printf("%s %s\n", cur->user_name, candidate_passwd);
-        crack_cnt += 1;
-        break;
-      } else {
-        // No match. continue to the next user
-        cur = cur->next;
+  char next[PASSWORD_LENGTH];  //< The next password to try
+  candidate_at(args->start, next);
+  for (int i = args->start; i <= args->end; i += MD5_BATCH) {
+    // Fill a batch with the next candidates
+    char candidates[MD5_BATCH][PASSWORD_LENGTH];  //< The passwords we are trying
+    int count = args->end - i + 1 < MD5_BATCH ? args->end - i + 1 : MD5_BATCH;
+    fill_batch(candidates, next, count);
+
+    // Take our candidate passwords and hash them all using MD5
+    uint8_t candidate_hashes[MD5_BATCH][MD5_DIGEST_LENGTH];  //< The hashes of the candidates
+    md5_batch(candidates, candidate_hashes);
+
+    for (int k = 0; k < count; k++) {
+      password_set_t* temp = args->candidates;
+      // use cur to traverse the whole list to see if there is a match
+      linked_list_t* cur = temp->header;
+
+      while (cur != NULL) {
+        // Now check if the hash of the candidate password matches the input hash
+        if (memcmp(cur->hash_password, candidate_hashes[k], MD5_DIGEST_LENGTH) == 0) {
+          // Match! print it out and increase crack_cnt by 1
+          printf("%s %.*s\n", cur->user_name, PASSWORD_LENGTH, candidates[k]);
+          crack_cnt += 1;
+          break;
+        } else {
+          // No match. continue to the next user
+          cur = cur->next;
+        }
       }
     }
   }
@@ -175,7 +434,7 @@ void linkedlist_clean(linked_list_t* header) {
  */
 int crack_password_list(password_set_t* passwords) {
   // we have four threads, and each thread should check 1/4 of the total number of passwords.
-  int thread_load = pow(26, PASSWORD_LENGTH) / 4;
+  int thread_load = num_candidates() / 4;
 
   // create fourse threads and its arguments
   pthread_t threads[4];
@@ -190,7 +449,7 @@ int crack_password_list(password_set_t* passwords) {
     if (i != (4 - 1)) {
       end = (i + 1) * thread_load - 1;
     } else {
-      end = pow(26, PASSWORD_LENGTH) - 1;
+      end = num_candidates() - 1;
     }
     args[i].start = start;
     args[i].end = end;
@@ -255,6 +514,9 @@ int main(int argc, char** argv) {
     exit(1);
   }
 
+  // Hash candidates with the widest vector instructions this CPU has
+  md5_init();
+
   if (strcmp(argv[1], "single") == 0) {
     // The input MD5 hash is a string in hexadecimal. Convert it to bytes.
     uint8_t input_hash[MD5_DIGEST_LENGTH];
@@ -0,0 +1,274 @@
+#include "lazycopy.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+// Histograms have one bucket per power of two, so bucket i counts latencies in [2^i, 2^(i+1))
+#define HIST_BUCKETS 40
+
+// How many chunks lazy copies copy ahead of sequential write faults in the runs that use it
+#define FAULT_AHEAD 16
+
+// Chunk counts to sweep. A different largest count can be given on the command line.
+size_t chunk_counts[] = {256, 1024, 4096};
+#define NUM_CHUNK_COUNTS (sizeof(chunk_counts) / sizeof(chunk_counts[0]))
+
+// Write densities to sweep, in writes per chunk
+double densities[] = {0.01, 0.05, 0.1, 0.25, 0.5, 1, 2, 4};
+#define NUM_DENSITIES (sizeof(densities) / sizeof(densities[0]))
+
+// The ways the benchmark picks which chunk to write
+typedef enum pattern {
+  PATTERN_SEQUENTIAL,  // walk through the chunks in order
+  PATTERN_RANDOM,      // pick any chunk with equal chance
+  PATTERN_HOTSPOT,     // send 90% of writes to the first 10% of chunks
+  NUM_PATTERNS,
+} pattern_t;
+
+const char* pattern_names[] = {"sequential", "random", "hot-spot"};
+
+// Latencies of individual writes, in nanoseconds and in CPU cycles
+typedef struct histogram {
+  size_t ns[HIST_BUCKETS];
+  size_t cycles[HIST_BUCKETS];
+  size_t count;
+} histogram_t;
+
+// The result of copying some chunks and then writing to the copies
+typedef struct result {
+  size_t copy_ns;   // time spent copying
+  size_t write_ns;  // time spent writing, including any faults
+  size_t faults;    // number of writes that took a copy-on-write fault
+} result_t;
+
+// Get the time in nanoseconds from a clock that never jumps
+size_t time_ns() {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+    perror("clock_gettime");
+    exit(2);
+  }
+  return ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Read the CPU's time stamp counter, or return zero on CPUs without one
+uint64_t cycles() {
+#if defined(__x86_64__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+// Find the histogram bucket for a value
+int bucket(uint64_t value) {
+  int b = 0;
+  while (value > 1 && b < HIST_BUCKETS - 1) {
+    value >>= 1;
+    b++;
+  }
+  return b;
+}
+
+// Add every count in one histogram to another
+void histogram_add(histogram_t* into, histogram_t* from) {
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    into->ns[i] += from->ns[i];
+    into->cycles[i] += from->cycles[i];
+  }
+  into->count += from->count;
+}
+
+// Find an upper bound on the latency below which fraction of the writes fall
+size_t histogram_percentile(histogram_t* hist, double fraction) {
+  size_t seen = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += hist->ns[i];
+    if (seen >= fraction * hist->count) return (size_t)2 << i;
+  }
+  return 0;
+}
+
+// Pick the chunk the ith write goes to
+size_t pick_chunk(pattern_t pattern, size_t i, size_t num_chunks) {
+  if (pattern == PATTERN_SEQUENTIAL) return i % num_chunks;
+  if (pattern == PATTERN_RANDOM || rand() % 10 == 0) return rand() % num_chunks;
+  size_t hot = num_chunks / 10 > 0 ? num_chunks / 10 : 1;
+  return rand() % hot;
+}
+
+/**
+ * Copy some chunks, then write to the copies and time every write.
+ *
+ * \param num_chunks  The number of chunks to copy
+ * \param num_writes  The number of writes to make to the copies
+ * \param pattern     How to pick which chunk each write goes to
+ * \param eager       Copy eagerly if true, lazily otherwise
+ * \param hist        The latency of each write is added to this histogram
+ * \returns the time spent copying and writing
+ */
+result_t run(size_t num_chunks, size_t num_writes, pattern_t pattern, bool eager,
+             histogram_t* hist) {
+  result_t result = {0, 0, 0};
+  int** originals = malloc(sizeof(int*) * num_chunks);
+  int** copies = malloc(sizeof(int*) * num_chunks);
+  if (originals == NULL || copies == NULL) {
+    perror("malloc failed");
+    exit(2);
+  }
+
+  // Fill every page of the originals so copies have real data to share
+  for (size_t i = 0; i < num_chunks; i++) {
+    originals[i] = chunk_alloc();
+    memset(originals[i], i, CHUNKSIZE);
+  }
+
+  size_t copy_start = time_ns();
+  for (size_t i = 0; i < num_chunks; i++) {
+    copies[i] = eager ? chunk_copy_eager(originals[i]) : chunk_copy_lazy(originals[i]);
+  }
+  size_t write_start = time_ns();
+  result.copy_ns = write_start - copy_start;
+
+  // Time every write on its own. Writes that take a fault show up in the slow buckets.
+  srand(43);
+  size_t faults_before = lazy_fault_count();
+  for (size_t i = 0; i < num_writes; i++) {
+    size_t chunk = pick_chunk(pattern, i, num_chunks);
+    size_t offset = rand() % (CHUNKSIZE / sizeof(int));
+
+    size_t start_ns = time_ns();
+    uint64_t start_cycles = cycles();
+    copies[chunk][offset] = i;
+    uint64_t end_cycles = cycles();
+    size_t end_ns = time_ns();
+
+    hist->ns[bucket(end_ns - start_ns)]++;
+    hist->cycles[bucket(end_cycles - start_cycles)]++;
+    hist->count++;
+  }
+  result.write_ns = time_ns() - write_start;
+  result.faults = lazy_fault_count() - faults_before;
+
+  // Give the chunks back so the next run gets the same ones in the same order. The pool hands
+  // back the last chunk freed first, so free them in the reverse of the order they were made.
+  // That keeps the copies at rising addresses, like the fresh chunks of the first run.
+  for (size_t i = num_chunks; i > 0; i--) {
+    chunk_free(copies[i - 1]);
+  }
+  for (size_t i = num_chunks; i > 0; i--) {
+    chunk_free(originals[i - 1]);
+  }
+  free(originals);
+  free(copies);
+  return result;
+}
+
+// Print the non-empty buckets of a histogram
+void histogram_print(const char* name, histogram_t* hist) {
+  printf("%s: %lu writes\n", name, hist->count);
+  printf("  %22s %10s %24s %10s\n", "nanoseconds", "writes", "cycles", "writes");
+  int last = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    if (hist->ns[i] > 0 || hist->cycles[i] > 0) last = i;
+  }
+  for (int i = 0; i <= last; i++) {
+    if (hist->ns[i] == 0 && hist->cycles[i] == 0) continue;
+    printf("  [%9lu, %9lu) %10lu [%11lu, %11lu) %10lu\n", (size_t)1 << i, (size_t)2 << i,
+           hist->ns[i], (size_t)1 << i, (size_t)2 << i, hist->cycles[i]);
+  }
+}
+
+int main(int argc, char** argv) {
+  if (argc > 2) {
+    fprintf(stderr, "Usage: %s [largest chunk count]\n", argv[0]);
+    exit(1);
+  }
+  if (argc == 2) chunk_counts[NUM_CHUNK_COUNTS - 1] = atol(argv[1]);
+
+  chunk_startup();
+  printf("Eager copies use %s\n\n", chunk_copy_eager_engine());
+
+  // Latencies of every write, by copy mode and pattern
+  histogram_t totals[2][NUM_PATTERNS];
+  memset(totals, 0, sizeof(totals));
+
+  printf("%7s %-10s %12s %10s %10s %10s %10s %8s %10s %8s %8s\n", "chunks", "pattern",
+         "writes/chunk", "eager us", "lazy us", "lazy p50", "lazy p99", "faults", "ahead us",
+         "faults", "winner");
+  for (size_t c = 0; c < NUM_CHUNK_COUNTS; c++) {
+    for (pattern_t p = 0; p < NUM_PATTERNS; p++) {
+      // The crossovers are the lowest densities from which eager copying stays ahead of lazy
+      // copying, and from which copying ahead of faults stays ahead of plain lazy copying
+      double crossover = -1;
+      double ahead_crossover = -1;
+      for (size_t d = 0; d < NUM_DENSITIES; d++) {
+        size_t num_chunks = chunk_counts[c];
+        size_t num_writes = densities[d] * num_chunks;
+        if (num_writes == 0) num_writes = 1;
+
+        histogram_t eager_hist;
+        histogram_t lazy_hist;
+        memset(&eager_hist, 0, sizeof(histogram_t));
+        memset(&lazy_hist, 0, sizeof(histogram_t));
+        result_t eager = run(num_chunks, num_writes, p, true, &eager_hist);
+        result_t lazy = run(num_chunks, num_writes, p, false, &lazy_hist);
+
+        // Run lazy copying again, copying ahead of sequential faults
+        histogram_t ahead_hist;
+        memset(&ahead_hist, 0, sizeof(histogram_t));
+        lazy_set_fault_ahead(FAULT_AHEAD);
+        result_t ahead = run(num_chunks, num_writes, p, false, &ahead_hist);
+        lazy_set_fault_ahead(0);
+
+        histogram_add(&totals[0][p], &eager_hist);
+        histogram_add(&totals[1][p], &lazy_hist);
+
+        size_t eager_ns = eager.copy_ns + eager.write_ns;
+        size_t lazy_ns = lazy.copy_ns + lazy.write_ns;
+        size_t ahead_ns = ahead.copy_ns + ahead.write_ns;
+        if (eager_ns <= lazy_ns && crossover < 0) crossover = densities[d];
+        if (eager_ns > lazy_ns) crossover = -1;
+        if (ahead_ns < lazy_ns && ahead_crossover < 0) ahead_crossover = densities[d];
+        if (ahead_ns >= lazy_ns) ahead_crossover = -1;
+
+        printf("%7lu %-10s %12.2f %10lu %10lu %9luns %9luns %8lu %10lu %8lu %8s\n", num_chunks,
+               pattern_names[p], densities[d], eager_ns / 1000, lazy_ns / 1000,
+               histogram_percentile(&lazy_hist, 0.5), histogram_percentile(&lazy_hist, 0.99),
+               lazy.faults, ahead_ns / 1000, ahead.faults, eager_ns <= lazy_ns ? "eager" : "lazy");
+      }
+
+      if (crossover < 0) {
+        printf("  -> lazy copying wins at every density tested\n");
+      } else {
+        printf("  -> eager copying wins from %.2f writes per chunk\n", crossover);
+      }
+      if (ahead_crossover < 0) {
+        printf("  -> copying %d chunks ahead of faults does not stay ahead at any density\n",
+               FAULT_AHEAD);
+      } else {
+        printf("  -> copying %d chunks ahead of faults wins from %.2f writes per chunk\n",
+               FAULT_AHEAD, ahead_crossover);
+      }
+    }
+  }
+
+  printf("\nWrite latency over all runs\n");
+  for (pattern_t p = 0; p < NUM_PATTERNS; p++) {
+    char name[64];
+    snprintf(name, sizeof(name), "Eager, %s", pattern_names[p]);
+    histogram_print(name, &totals[0][p]);
+    snprintf(name, sizeof(name), "Lazy, %s", pattern_names[p]);
+    histogram_print(name, &totals[1][p]);
+  }
+
+  return 0;
+}
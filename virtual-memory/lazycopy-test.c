@@ -1,18 +1,40 @@
 #include "lazycopy.h"
 
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
 #include <time.h>
+#include <unistd.h>
 
 #define NUM_TESTS 2000
 #define NUM_WRITES 100
+#define RANGE_SIZE (128 * 1024 * 1024)
+#define RANGE_WRITES 1000
+#define CHECKPOINT_CHUNKS 64
+#define CHECKPOINT_EPOCHS 4
+#define CHECKPOINT_WRITES 1000
+#define FILE_SIZE (64 * 1024 * 1024 + 100)
+#define FILE_WRITES 100
+#define AHEAD_CHUNKS 64
+#define AHEAD_DISTANCE 8
 
 size_t time_us();
 
 void run_tests(int** originals, int** copies, bool eager);
 
+bool run_range_test();
+
+bool run_checkpoint_test(checkpoint_mode_t mode);
+
+bool run_overlap_checkpoint_test();
+
+bool run_file_test();
+
+bool run_fault_ahead_test();
+
 int main() {
   // Initialize the lazy copying chunk code
   chunk_startup();
@@ -43,6 +65,58 @@ int main() {
     }
   }
 
+  // Freed chunks should come back from chunk_alloc zeroed, even if they were lazy copies
+  for (size_t i = 0; i < NUM_TESTS; i++) {
+    chunk_free(eager_copies[i]);
+    chunk_free(lazy_copies[i]);
+  }
+  for (size_t i = 0; i < 2 * NUM_TESTS; i++) {
+    int* chunk = chunk_alloc();
+    if (chunk[0] != 0 || chunk[CHUNKSIZE / sizeof(int) - 1] != 0) {
+      printf("Error! Freed chunks are not cleared.\n");
+      return 1;
+    }
+    chunk[0] = 1;
+  }
+
+  // Check that a large range can be copied lazily too
+  if (!run_range_test()) {
+    printf("Error! Lazy range copying appears to be broken.\n");
+    return 1;
+  }
+
+  // Check that checkpoints record exactly the pages written after them, in both modes
+  if (!run_checkpoint_test(CHECKPOINT_FAULT)) {
+    printf("Error! Checkpoints appear to be broken.\n");
+    return 1;
+  }
+  if (!run_overlap_checkpoint_test()) {
+    printf("Error! Overlapping checkpoints appear to be broken.\n");
+    return 1;
+  }
+  if (checkpoint_set_mode(CHECKPOINT_SCAN)) {
+    bool ok = run_checkpoint_test(CHECKPOINT_SCAN);
+    checkpoint_set_mode(CHECKPOINT_FAULT);
+    if (!ok) {
+      printf("Error! Scanning checkpoints appear to be broken.\n");
+      return 1;
+    }
+  } else {
+    printf("Scan Checkpoint: soft-dirty bits are not supported by this kernel\n");
+  }
+
+  // Check that chunks copied ahead of a sequential writer hold the right data
+  if (!run_fault_ahead_test()) {
+    printf("Error! Copying ahead of write faults appears to be broken.\n");
+    return 1;
+  }
+
+  // Check that files can be copied into memory, changed, and saved without touching the original
+  if (!run_file_test()) {
+    printf("Error! Lazy file copying appears to be broken.\n");
+    return 1;
+  }
+
   return 0;
 }
 
@@ -100,11 +174,241 @@ void run_tests(int** originals, int** copies, bool eager) {
   // Get the end time for writing
   size_t write_end_time = time_us();
 
-  // Print timing information
-  printf("%s Copying: %luus\n", eager ? "Eager" : "Lazy", copy_end_time - copy_start_time);
+  // Print timing information, with how fast chunks were copied in megabytes per second
+  size_t copy_time = copy_end_time - copy_start_time;
+  double copy_rate = (double)NUM_TESTS * CHUNKSIZE / (copy_time > 0 ? copy_time : 1);
+  printf("%s Copying: %luus (%.0f MB/s with %s)\n", eager ? "Eager" : "Lazy", copy_time, copy_rate,
+         eager ? chunk_copy_eager_engine() : "mremap");
   printf("%s Writing: %luus\n", eager ? "Eager" : "Lazy", write_end_time - copy_end_time);
 }
 
+bool run_range_test() {
+  size_t page_ints = getpagesize() / sizeof(int);
+  size_t num_pages = RANGE_SIZE / getpagesize();
+
+  // Fill the first int of every page in a large range with its page number
+  int* original = range_alloc(RANGE_SIZE);
+  for (size_t i = 0; i < num_pages; i++) {
+    original[i * page_ints] = i;
+  }
+
+  // Copy the whole range lazily
+  size_t copy_start_time = time_us();
+  int* copy = lazy_copy_range(original, RANGE_SIZE);
+  size_t copy_end_time = time_us();
+
+  // Write to random pages in the copy, remembering which ones were written
+  bool* written = calloc(num_pages, sizeof(bool));
+  size_t num_written = 0;
+  for (size_t i = 0; i < RANGE_WRITES; i++) {
+    size_t page = rand() % num_pages;
+    copy[page * page_ints] = -1;
+    if (!written[page]) num_written++;
+    written[page] = true;
+  }
+  size_t write_end_time = time_us();
+
+  printf("Range Copying: %luus for %dMB\n", copy_end_time - copy_start_time,
+         RANGE_SIZE / (1024 * 1024));
+  printf("Range Writing: %luus\n", write_end_time - copy_end_time);
+
+  // The original must be unchanged, and only the written pages of the copy should differ
+  bool ok = lazy_dirty_pages(copy, NULL, 0) == num_written &&
+            lazy_dirty_pages(original, NULL, 0) == 0;
+  for (size_t i = 0; i < num_pages && ok; i++) {
+    int expected = written[i] ? -1 : (int)i;
+    if (original[i * page_ints] != (int)i || copy[i * page_ints] != expected ||
+        lazy_page_dirty(&copy[i * page_ints]) != written[i]) {
+      ok = false;
+    }
+  }
+  free(written);
+  return ok;
+}
+
+bool run_checkpoint_test(checkpoint_mode_t mode) {
+  size_t page_ints = getpagesize() / sizeof(int);
+  size_t chunk_pages = CHUNKSIZE / getpagesize();
+
+  // Allocate chunks and fill them with random values
+  int* chunks[CHECKPOINT_CHUNKS];
+  for (size_t i = 0; i < CHECKPOINT_CHUNKS; i++) {
+    chunks[i] = chunk_alloc();
+    for (size_t j = 0; j < CHUNKSIZE / sizeof(int); j++) {
+      chunks[i][j] = rand();
+    }
+  }
+
+  // Take several checkpoints in a row so pages written in one epoch get copied again in the next
+  FILE* file = tmpfile();
+  size_t file_size = 0;
+  size_t take_time = 0;
+  size_t write_time = 0;
+  size_t dirty_time = 0;
+  for (size_t epoch = 0; epoch < CHECKPOINT_EPOCHS; epoch++) {
+    size_t take_start_time = time_us();
+    checkpoint_t* cp = checkpoint_take((void**)chunks, CHECKPOINT_CHUNKS);
+    size_t write_start_time = time_us();
+    take_time += write_start_time - take_start_time;
+
+    // Write the first int of random pages, remembering which pages were written
+    bool written[CHECKPOINT_CHUNKS][chunk_pages];
+    memset(written, 0, sizeof(written));
+    int old_values[CHECKPOINT_CHUNKS][chunk_pages];
+    size_t num_written = 0;
+    for (size_t i = 0; i < CHECKPOINT_WRITES; i++) {
+      size_t chunk = rand() % CHECKPOINT_CHUNKS;
+      size_t page = rand() % chunk_pages;
+      if (!written[chunk][page]) {
+        old_values[chunk][page] = chunks[chunk][page * page_ints];
+        num_written++;
+      }
+      written[chunk][page] = true;
+      chunks[chunk][page * page_ints] = rand();
+    }
+    size_t dirty_start_time = time_us();
+    write_time += dirty_start_time - write_start_time;
+
+    // The checkpoint should list exactly the written pages, and the snapshots should be unchanged
+    checkpoint_page_t pages[CHECKPOINT_WRITES];
+    if (checkpoint_dirty(cp, pages, CHECKPOINT_WRITES) != num_written) return false;
+    dirty_time += time_us() - dirty_start_time;
+    for (size_t i = 0; i < num_written; i++) {
+      const int* snapshot = checkpoint_snapshot(cp, pages[i].chunk);
+      if (!written[pages[i].chunk][pages[i].page] ||
+          (snapshot != NULL &&
+           snapshot[pages[i].page * page_ints] != old_values[pages[i].chunk][pages[i].page])) {
+        return false;
+      }
+    }
+
+    // Only the written pages should go to the file
+    if (checkpoint_write(cp, fileno(file)) != num_written) return false;
+    file_size += num_written * (sizeof(checkpoint_page_t) + getpagesize());
+    checkpoint_release(cp);
+  }
+
+  // Print timing information
+  const char* name = mode == CHECKPOINT_FAULT ? "Fault" : "Scan";
+  printf("%s Checkpoint Taking: %luus\n", name, take_time);
+  printf("%s Checkpoint Writing: %luus\n", name, write_time);
+  printf("%s Checkpoint Listing: %luus\n", name, dirty_time);
+
+  bool ok = lseek(fileno(file), 0, SEEK_CUR) == file_size;
+  fclose(file);
+  return ok;
+}
+
+bool run_overlap_checkpoint_test() {
+  size_t page_ints = getpagesize() / sizeof(int);
+  int* chunks[3];
+  for (size_t i = 0; i < 3; i++) {
+    chunks[i] = chunk_alloc();
+  }
+
+  // A second checkpoint of a chunk is refused while the first is live, and so is a chunk given
+  // twice. The chunks copied before the refused one are let go again.
+  checkpoint_t* first = checkpoint_take((void**)chunks, 2);
+  chunks[0][page_ints] = 1;
+  void* overlapping[] = {chunks[2], chunks[1]};
+  void* repeated[] = {chunks[2], chunks[2]};
+  if (first == NULL || checkpoint_take(overlapping, 2) != NULL ||
+      checkpoint_take(repeated, 2) != NULL) {
+    return false;
+  }
+  checkpoint_t* other = checkpoint_take((void**)&chunks[2], 1);
+  if (other == NULL) return false;
+
+  // The first checkpoint still sees every write since it was taken, and only those
+  chunks[1][2 * page_ints] = 1;
+  chunks[2][0] = 1;
+  checkpoint_page_t pages[3];
+  if (checkpoint_dirty(first, pages, 3) != 2 || pages[0].chunk != 0 || pages[0].page != 1 ||
+      pages[1].chunk != 1 || pages[1].page != 2) {
+    return false;
+  }
+
+  // Once it is released, the chunks can be checkpointed again, starting from a clean slate
+  checkpoint_release(first);
+  checkpoint_t* second = checkpoint_take((void**)chunks, 2);
+  if (second == NULL || checkpoint_dirty(second, pages, 3) != 0) return false;
+  chunks[0][0] = 2;
+  bool ok = checkpoint_dirty(second, pages, 3) == 1 && pages[0].chunk == 0 && pages[0].page == 0 &&
+            checkpoint_dirty(other, pages, 3) == 1;
+
+  checkpoint_release(second);
+  checkpoint_release(other);
+  for (size_t i = 0; i < 3; i++) {
+    chunk_free(chunks[i]);
+  }
+  return ok;
+}
+
+bool run_file_test() {
+  // Make a file whose length is not a whole number of pages, filled with a known pattern
+  char original_path[] = "/tmp/lazycopy-test-XXXXXX";
+  char saved_path[] = "/tmp/lazycopy-test-XXXXXX";
+  int fd = mkstemp(original_path);
+  int saved_fd = mkstemp(saved_path);
+  if (fd == -1 || saved_fd == -1) {
+    perror("mkstemp");
+    exit(2);
+  }
+  close(saved_fd);
+  char* expected = malloc(FILE_SIZE);
+  for (size_t i = 0; i < FILE_SIZE; i++) {
+    expected[i] = i % 251;
+  }
+  if (write(fd, expected, FILE_SIZE) != FILE_SIZE) {
+    perror("write");
+    exit(2);
+  }
+
+  // Copy the file and make some changes, including to the last partial page
+  size_t copy_start_time = time_us();
+  size_t len;
+  char* copy = file_copy_lazy(original_path, &len);
+  size_t copy_end_time = time_us();
+  if (copy == NULL || len != FILE_SIZE) return false;
+  for (size_t i = 0; i < FILE_WRITES; i++) {
+    size_t offset = i == 0 ? FILE_SIZE - 1 : rand() % FILE_SIZE;
+    copy[offset] = expected[offset] = rand();
+  }
+
+  // Save the changed copy and check that both files hold what they should
+  size_t save_start_time = time_us();
+  if (file_copy_save(copy, saved_path) != 0) return false;
+  size_t save_end_time = time_us();
+  file_copy_free(copy);
+
+  printf("File Copying: %luus for %dMB\n", copy_end_time - copy_start_time,
+         FILE_SIZE / (1024 * 1024));
+  printf("File Saving: %luus\n", save_end_time - save_start_time);
+
+  bool ok = true;
+  char* contents = malloc(FILE_SIZE);
+  int saved = open(saved_path, O_RDONLY);
+  if (pread(saved, contents, FILE_SIZE, 0) != FILE_SIZE ||
+      pread(saved, contents, 1, FILE_SIZE) != 0 || memcmp(contents, expected, FILE_SIZE) != 0) {
+    ok = false;
+  }
+  for (size_t i = 0; i < FILE_SIZE; i++) {
+    expected[i] = i % 251;
+  }
+  if (pread(fd, contents, FILE_SIZE, 0) != FILE_SIZE ||
+      memcmp(contents, expected, FILE_SIZE) != 0) {
+    ok = false;
+  }
+
+  close(saved);
+  close(fd);
+  unlink(original_path);
+  unlink(saved_path);
+  free(contents);
+  free(expected);
+  return ok;
+}
+
 // Get the time in microseconds
 size_t time_us() {
   struct timeval tv;
@@ -116,3 +420,40 @@ size_t time_us() {
   // Convert timeval values to microseconds
   return tv.tv_sec * 1000000 + tv.tv_usec;
 }
+
+bool run_fault_ahead_test() {
+  int* originals[AHEAD_CHUNKS];
+  int* copies[AHEAD_CHUNKS];
+  for (size_t i = 0; i < AHEAD_CHUNKS; i++) {
+    originals[i] = chunk_alloc();
+    for (size_t j = 0; j < CHUNKSIZE / sizeof(int); j++) {
+      originals[i][j] = i * j;
+    }
+  }
+  for (size_t i = 0; i < AHEAD_CHUNKS; i++) {
+    copies[i] = chunk_copy_lazy(originals[i]);
+  }
+
+  // Write one value to each copy in order, so the faults come one chunk apart
+  size_t previous = lazy_set_fault_ahead(AHEAD_DISTANCE);
+  size_t faults_before = lazy_fault_count();
+  for (size_t i = 0; i < AHEAD_CHUNKS; i++) {
+    copies[i][i] = -1;
+  }
+  size_t faults = lazy_fault_count() - faults_before;
+  lazy_set_fault_ahead(previous);
+
+  printf("Fault Ahead: %lu faults writing %d chunks\n", faults, AHEAD_CHUNKS);
+
+  // Every copy holds the original's values except the one written, and the originals are unchanged
+  bool ok = faults < AHEAD_CHUNKS;
+  for (size_t i = 0; i < AHEAD_CHUNKS; i++) {
+    for (size_t j = 0; j < CHUNKSIZE / sizeof(int); j++) {
+      int expected = i * j;
+      if (originals[i][j] != expected || copies[i][j] != (j == i ? -1 : expected)) ok = false;
+    }
+    chunk_free(originals[i]);
+    chunk_free(copies[i]);
+  }
+  return ok;
+}
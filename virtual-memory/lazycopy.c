@@ -1,61 +1,547 @@
 #define _GNU_SOURCE
 #include "lazycopy.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <linux/types.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
-//making max_pages to keeptrack of how many pages we have, and pages which will be an array of all pages
-int max_pages = 0;
-void** pages = NULL;
-//making num_pages to keep track of how many pages we currently have copied
-int num_pages = 0;
-//seg finder finds the index of pages where the seg fault occured
-int segfinder(siginfo_t* info) {
-  //finding address of seg fault
-  intptr_t p = (intptr_t)info->si_addr;
-  int i = 0;
-  while (i < num_pages) { //looping through pages to see if the seg fault occured on each page
-    if (((intptr_t)pages[i] <= p) && ((intptr_t)pages[i] + CHUNKSIZE > p)) {
-      return i;
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Older kernel headers do not have PAGEMAP_SCAN (added in Linux 6.7), so define what we use of it.
+// The ioctl fails with ENOTTY on kernels that do not have it, and we fall back to reading pagemap.
+#ifndef PAGEMAP_SCAN
+#define PAGEMAP_SCAN _IOWR('f', 16, struct pm_scan_arg)
+#define PAGE_IS_SOFT_DIRTY (1 << 7)
+
+struct page_region {
+  __u64 start;
+  __u64 end;
+  __u64 categories;
+};
+
+struct pm_scan_arg {
+  __u64 size;
+  __u64 flags;
+  __u64 start;
+  __u64 end;
+  __u64 walk_end;
+  __u64 vec;
+  __u64 vec_len;
+  __u64 max_pages;
+  __u64 category_inverted;
+  __u64 category_mask;
+  __u64 category_anyof_mask;
+  __u64 return_mask;
+};
+#endif
+
+// Bits of a /proc/self/pagemap entry
+#define PAGEMAP_SOFT_DIRTY (1ULL << 55)  // written since soft-dirty bits were cleared
+#define PAGEMAP_FILE (1ULL << 61)        // maps a page of a file (or shared memory)
+#define PAGEMAP_SWAPPED (1ULL << 62)     // swapped out
+#define PAGEMAP_PRESENT (1ULL << 63)     // in memory
+
+// How many pagemap entries or scan results to read at a time
+#define SCAN_BATCH 512
+
+// How far ahead of the copy loop the eager copy engine prefetches the source, in bytes
+#define PREFETCH_DISTANCE 1024
+
+// chunk_startup times each eager copy loop copying this many chunks and reading the copies back,
+// takes the best of this many tries, and only swaps memcpy out for a streaming copy that beats it
+// by the given percentage
+#define CALIBRATE_CHUNKS 16
+#define CALIBRATE_TRIES 5
+#define CALIBRATE_MARGIN 10
+
+// How many chunks the chunk pool reserves with each mmap call
+#define POOL_CHUNKS 1024
+
+// How many streams of faults the fault handler follows at once, how far apart two faults can be
+// to start a stream, and the most chunks it can copy ahead of a stream at once
+#define NUM_STREAMS 4
+#define STREAM_WINDOW (16 * CHUNKSIZE)
+#define MAX_FAULT_AHEAD 64
+
+// MADV_POPULATE_WRITE is new in Linux 5.14. Older kernels reject it and we skip prefaulting.
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+// A lazily copied region of memory. Every lazy copy creates two of these, one for the original and
+// one for the copy, and each one points at the other through peer.
+typedef struct lazy_region {
+  intptr_t start;            // address of the first byte in the region
+  size_t size;               // size of the region in bytes
+  size_t granule;            // number of bytes made writable by a single write fault
+  uint8_t* dirty;            // one bit per granule, set once that granule has been written
+  uint8_t* split;            // one bit per page, set if that page is a mapping of its own
+  struct lazy_region* peer;  // the other side of this copy, or NULL if it was released
+  checkpoint_t* checkpoint;  // the live checkpoint recording writes here, or NULL if there is none
+} lazy_region_t;
+
+// A run of write faults that are the same distance apart, like a loop writing to one chunk after
+// another. The fault handler uses these to copy granules before they are written.
+typedef struct fault_stream {
+  intptr_t last;    // the granule this stream expects the next fault to be one stride after
+  intptr_t stride;  // the distance between the last two faults, or 0 after only one fault
+} fault_stream_t;
+
+// A checkpoint is a lazy snapshot of a set of chunks
+struct checkpoint {
+  checkpoint_mode_t mode;  // how writes after the checkpoint are found
+  size_t num_chunks;       // number of chunks in the checkpoint
+  void** chunks;           // the chunks the application keeps using
+  void** snapshots;        // read-only copies of the chunks, or NULL in CHECKPOINT_SCAN mode
+};
+
+// A file copied with file_copy_lazy. These are kept in a linked list.
+typedef struct file_copy {
+  void* addr;              // where the copy is mapped
+  size_t len;              // the length of the file
+  int fd;                  // the file, kept open so file_copy_save can copy from it
+  struct file_copy* next;  // the next file copy in the list
+} file_copy_t;
+
+// every file copy that has not been freed
+file_copy_t* file_copies = NULL;
+
+// The fault streams the handler is following. A new stream replaces the oldest one.
+fault_stream_t streams[NUM_STREAMS];
+int next_stream = 0;
+// how many granules to copy ahead of a stream, or 0 to never copy ahead
+size_t fault_ahead = 0;
+// how many write faults the handler has taken
+size_t num_faults = 0;
+
+// the mode new checkpoints use
+checkpoint_mode_t checkpoint_mode = CHECKPOINT_FAULT;
+
+// /proc/self/pagemap and /proc/self/clear_refs, opened the first time scan mode is used
+int pagemap_fd = -1;
+int clear_refs_fd = -1;
+// whether the pagemap fd understands the PAGEMAP_SCAN ioctl
+bool has_pagemap_scan = true;
+
+// size of a page, filled in by chunk_startup
+size_t page_size = 0;
+
+// The chunk pool. Chunks are carved out of large shared mappings so handing out a chunk does not
+// need a system call. pool_next is the next never-used chunk in the newest mapping, and
+// free_chunks is a stack of chunks returned with chunk_free.
+char* pool_next = NULL;
+char* pool_end = NULL;
+void** free_chunks = NULL;
+size_t num_free_chunks = 0;
+size_t max_free_chunks = 0;
+
+//making max_regions to keep track of how much room we have, and regions which will be an array of
+//all lazy regions sorted by start address
+int max_regions = 0;
+lazy_region_t** regions = NULL;
+//making num_regions to keep track of how many regions are currently lazily copied
+int num_regions = 0;
+
+//bit_test checks bit i in the bitmap bits
+bool bit_test(uint8_t* bits, size_t i) {
+  return (bits[i / 8] & (1 << (i % 8))) != 0;
+}
+
+//bit_set sets bit i in the bitmap bits
+void bit_set(uint8_t* bits, size_t i) {
+  bits[i / 8] |= 1 << (i % 8);
+}
+
+//region_index finds the index of the first region that ends after address p (binary search)
+int region_index(intptr_t p) {
+  int lo = 0;
+  int hi = num_regions;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (regions[mid]->start + (intptr_t)regions[mid]->size <= p) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+//region_find finds the region holding address p, or NULL if p is not in a lazy region
+lazy_region_t* region_find(intptr_t p) {
+  int i = region_index(p);
+  if (i < num_regions && regions[i]->start <= p) return regions[i];
+  return NULL;
+}
+
+//region_remove takes region r out of the region array and frees it
+void region_remove(lazy_region_t* r) {
+  int i = region_index(r->start);
+  memmove(&regions[i], &regions[i + 1], sizeof(lazy_region_t*) * (num_regions - i - 1));
+  num_regions--;
+  if (r->peer != NULL) r->peer->peer = NULL;
+  free(r->dirty);
+  free(r->split);
+  free(r);
+}
+
+//region_add records a new lazy region of size bytes at start that is made writable granule bytes
+//at a time. split says which pages are already mappings of their own.
+lazy_region_t* region_add(intptr_t start, size_t size, size_t granule, uint8_t* split) {
+  // The same memory can be lazily copied again. The newest copy replaces the old record.
+  int i = region_index(start);
+  if (i < num_regions && regions[i]->start == start && regions[i]->size == size) {
+    region_remove(regions[i]);
+  } else if (i < num_regions && regions[i]->start < start + (intptr_t)size) {
+    fprintf(stderr, "lazy copy overlaps part of an existing lazy copy\n");
+    exit(2);
+  }
+
+  // checking if we have room in our region array for the new region
+  if (num_regions >= max_regions) {
+    max_regions += 64;
+    regions = realloc(regions, sizeof(lazy_region_t*) * max_regions);
+    if (regions == NULL) {
+      perror("realloc failed");
+      exit(2);
     }
-    i++;
   }
-  return -1;
+
+  lazy_region_t* r = malloc(sizeof(lazy_region_t));
+  uint8_t* dirty = calloc((size / granule + 7) / 8, 1);
+  uint8_t* split_copy = malloc((size / page_size + 7) / 8);
+  if (r == NULL || dirty == NULL || split_copy == NULL) {
+    perror("malloc failed");
+    exit(2);
+  }
+  memcpy(split_copy, split, (size / page_size + 7) / 8);
+  r->start = start;
+  r->size = size;
+  r->dirty = dirty;
+  r->split = split_copy;
+  r->granule = granule;
+  r->peer = NULL;
+  r->checkpoint = NULL;
+
+  // placing the region so the array stays sorted
+  memmove(&regions[i + 1], &regions[i], sizeof(lazy_region_t*) * (num_regions - i));
+  regions[i] = r;
+  num_regions++;
+  return r;
+}
+
+/**
+ * Give a lazily copied granule the writable memory at fresh. The contents are copied there, and
+ * then fresh is moved over the read-only granule.
+ *
+ * \param r      The region that holds the granule
+ * \param index  The index of the granule within the region
+ * \param fresh  Shared, writable memory the size of the granule that nothing else uses
+ */
+void privatize_into(lazy_region_t* r, size_t index, void* fresh) {
+  void* target = (void*)(r->start + index * r->granule);
+
+  //copying data from the shared granule to the new memory
+  memcpy(fresh, target, r->granule);
+  //moving the new memory to where the granule was
+  if (mremap(fresh, r->granule, r->granule, MREMAP_MAYMOVE | MREMAP_FIXED, target) ==
+      MAP_FAILED) {
+    perror("mremap failed");
+    exit(2);
+  }
+  bit_set(r->dirty, index);
+
+  // The granule is now a mapping of its own, which matters if this region is ever copied again
+  if (r->granule == r->size) {
+    memset(r->split, 0, (r->size / page_size + 7) / 8);
+  } else {
+    for (size_t i = 0; i < r->granule / page_size; i++) {
+      bit_set(r->split, index * (r->granule / page_size) + i);
+    }
+  }
+}
+
+/**
+ * Give a lazily copied granule its own writable memory. The contents are copied to a fresh shared
+ * mapping, which is then moved over the read-only granule. This avoids calling malloc, which is not
+ * safe to do in a signal handler.
+ *
+ * \param r      The region that holds the granule
+ * \param index  The index of the granule within the region
+ */
+void privatize(lazy_region_t* r, size_t index) {
+  //allocating physical memory for the granule to write to
+  void* fresh =
+      mmap(NULL, r->granule, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+  if (fresh == MAP_FAILED) {
+    perror("mmap failed");
+    exit(2);
+  }
+  privatize_into(r, index, fresh);
+}
+
+/**
+ * Give several lazily copied chunks their own writable memory at once. Most of the cost of a copy
+ * is faulting in the fresh pages one at a time, so they all come from one mapping that is filled
+ * in with a single system call, and then each chunk's part of it is moved into place.
+ *
+ * \param chunks  The regions of the chunks, each a whole chunk that has not been written
+ * \param count   The number of chunks
+ */
+void privatize_chunks(lazy_region_t** chunks, size_t count) {
+  char* fresh = mmap(NULL, count * CHUNKSIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_SHARED,
+                     -1, 0);
+  if (fresh == MAP_FAILED) {
+    perror("mmap failed");
+    exit(2);
+  }
+  madvise(fresh, count * CHUNKSIZE, MADV_POPULATE_WRITE);
+  for (size_t i = 0; i < count; i++) {
+    privatize_into(chunks[i], 0, fresh + i * CHUNKSIZE);
+  }
+}
+
+/**
+ * Record a write fault on a lazily copied chunk, and if it continues a stream of faults with a
+ * fixed stride, copy the next few chunks of that stream now so the writer does not fault on them.
+ * Streams are followed separately, so a loop over one set of copies is not confused by writes to
+ * another, and writes that don't follow a stride never copy anything extra.
+ *
+ * Only chunk copies are copied ahead. Ranges and checkpoints copy a page at a time so they can
+ * report exactly which pages were written, and copying ahead would mark unwritten pages.
+ *
+ * \param granule  The address of the chunk that faulted
+ */
+void fault_ahead_after(intptr_t granule) {
+  // Find the stream this fault continues, or one that faulted close by to learn a stride from
+  fault_stream_t* s = NULL;
+  bool matched = false;
+  for (int i = 0; i < NUM_STREAMS && !matched; i++) {
+    intptr_t distance = granule - streams[i].last;
+    if (streams[i].stride != 0 && distance == streams[i].stride) {
+      s = &streams[i];
+      matched = true;
+    } else if (s == NULL && streams[i].last != 0 && distance != 0 && distance <= STREAM_WINDOW &&
+               distance >= -STREAM_WINDOW) {
+      s = &streams[i];
+    }
+  }
+
+  // Start a new stream if this fault isn't near any other
+  if (s == NULL) {
+    s = &streams[next_stream];
+    next_stream = (next_stream + 1) % NUM_STREAMS;
+    s->last = granule;
+    s->stride = 0;
+    return;
+  }
+  if (!matched) {
+    s->stride = granule - s->last;
+    s->last = granule;
+    return;
+  }
+
+  // Two faults in a row have had the same stride. Copy the next chunks in the stream together.
+  s->last = granule;
+  lazy_region_t* ahead[MAX_FAULT_AHEAD];
+  size_t count = 0;
+  for (size_t i = 0; i < fault_ahead; i++) {
+    intptr_t next = s->last + s->stride;
+    lazy_region_t* r = region_find(next);
+    if (r == NULL || r->start != next || r->size != CHUNKSIZE || r->granule != r->size) break;
+    if (!bit_test(r->dirty, 0)) ahead[count++] = r;
+    s->last = next;
+  }
+  if (count > 0) privatize_chunks(ahead, count);
 }
 
 void seg_fault_remap(int signal, siginfo_t* info, void* ctx) {
-  //getting index of seg fault page in address
-  int i = segfinder(info);
-  if (i == -1){ //checking segfault was because we wrote to read only pages
+  //getting the lazy region the seg fault happened in
+  intptr_t p = (intptr_t)info->si_addr;
+  lazy_region_t* r = region_find(p);
+  size_t index = r == NULL ? 0 : (p - r->start) / r->granule;
+  //checking segfault was because we wrote to read only pages
+  if (r == NULL || bit_test(r->dirty, index)) {
     printf("Life ain't all sunshine and segmentation faults.");
     exit(1);
   }
-  //temporarily copying to temp
-  void* temp = malloc(CHUNKSIZE);
-  if (memcpy(temp, pages[i], CHUNKSIZE) < 0) perror("memcpy Failed");
-  //allocating physical memory for page to write to
-  pages[i] = mmap(pages[i], CHUNKSIZE, PROT_READ | PROT_WRITE,
-                  MAP_ANONYMOUS | MAP_SHARED | MAP_FIXED, -1, 0);
+  num_faults++;
+  privatize(r, index);
+  if (fault_ahead > 0 && r->granule == r->size) fault_ahead_after(r->start);
+}
 
-  // Check for an error
-  if (pages[i] == MAP_FAILED) {
-    perror("mmap failed");
-    exit(2);
+/**
+ * Set how many chunks the fault handler copies ahead when writes to lazily copied chunks fault in
+ * a regular stride. This is off until it is set, since it only pays off for programs that go on to
+ * write most of the chunks they copy. Chunks copied ahead count as written for lazy_page_dirty.
+ *
+ * \param chunks  The number of chunks to copy ahead, or 0 to only copy chunks that are written.
+ *                At most MAX_FAULT_AHEAD are used.
+ * \returns the previous setting
+ */
+size_t lazy_set_fault_ahead(size_t chunks) {
+  size_t previous = fault_ahead;
+  fault_ahead = chunks < MAX_FAULT_AHEAD ? chunks : MAX_FAULT_AHEAD;
+  return previous;
+}
+
+/**
+ * Get the number of write faults on lazy copies so far.
+ *
+ * \returns the number of faults
+ */
+size_t lazy_fault_count() {
+  return num_faults;
+}
+
+// The function chunk_copy_eager uses to copy, and its name. This is memcpy unless chunk_startup
+// measures a streaming copy this CPU supports to be clearly faster.
+void* (*eager_copy)(void* dest, const void* src, size_t len) = memcpy;
+const char* eager_copy_name = "memcpy";
+
+#if defined(__x86_64__)
+/**
+ * Copy with AVX-512 non-temporal stores. The stores go around the cache, so copying does not evict
+ * data the program is using to make room for a copy it may never read.
+ *
+ * \param dest  Where to copy to. Must be 64 byte aligned.
+ * \param src   Where to copy from. Must be 64 byte aligned.
+ * \param len   The number of bytes to copy. Must be a multiple of 256.
+ * \returns dest, like memcpy
+ */
+__attribute__((target("avx512f"))) void* copy_avx512(void* dest, const void* src, size_t len) {
+  __m512i* d = dest;
+  const __m512i* s = src;
+  for (size_t i = 0; i < len / sizeof(__m512i); i += 4) {
+    _mm_prefetch((const char*)&s[i] + PREFETCH_DISTANCE, _MM_HINT_NTA);
+    __m512i a = _mm512_load_si512(&s[i]);
+    __m512i b = _mm512_load_si512(&s[i + 1]);
+    __m512i c = _mm512_load_si512(&s[i + 2]);
+    __m512i e = _mm512_load_si512(&s[i + 3]);
+    _mm512_stream_si512(&d[i], a);
+    _mm512_stream_si512(&d[i + 1], b);
+    _mm512_stream_si512(&d[i + 2], c);
+    _mm512_stream_si512(&d[i + 3], e);
+  }
+  // make the streaming stores visible before anyone reads the copy
+  _mm_sfence();
+  return dest;
+}
+
+/**
+ * Copy with AVX2 non-temporal stores. Same as copy_avx512 but 32 bytes at a time.
+ *
+ * \param dest  Where to copy to. Must be 32 byte aligned.
+ * \param src   Where to copy from. Must be 32 byte aligned.
+ * \param len   The number of bytes to copy. Must be a multiple of 256.
+ * \returns dest, like memcpy
+ */
+__attribute__((target("avx2"))) void* copy_avx2(void* dest, const void* src, size_t len) {
+  __m256i* d = dest;
+  const __m256i* s = src;
+  for (size_t i = 0; i < len / sizeof(__m256i); i += 8) {
+    _mm_prefetch((const char*)&s[i] + PREFETCH_DISTANCE, _MM_HINT_NTA);
+    _mm_prefetch((const char*)&s[i + 4] + PREFETCH_DISTANCE, _MM_HINT_NTA);
+    for (size_t j = 0; j < 8; j++) {
+      _mm256_stream_si256(&d[i + j], _mm256_load_si256(&s[i + j]));
+    }
+  }
+  _mm_sfence();
+  return dest;
+}
+#endif
+
+/**
+ * Time one eager copy loop. It copies CALIBRATE_CHUNKS chunks into memory that is already populated,
+ * like chunk_copy_eager does, then reads every copy back. Streaming stores leave the copy out of
+ * the cache, so the read back charges them for the misses a program would take using the copy.
+ *
+ * \param copy  The copy loop to time
+ * \param src   CALIBRATE_CHUNKS chunks to copy from
+ * \param dest  CALIBRATE_CHUNKS chunks to copy to
+ * \returns the fastest of CALIBRATE_TRIES tries, in nanoseconds
+ */
+size_t time_eager_copy(void* (*copy)(void*, const void*, size_t), char* src, char* dest) {
+  size_t best = SIZE_MAX;
+  for (int t = 0; t < CALIBRATE_TRIES; t++) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < CALIBRATE_CHUNKS; i++) {
+      copy(dest + i * CHUNKSIZE, src + i * CHUNKSIZE, CHUNKSIZE);
+    }
+    for (size_t i = 0; i < CALIBRATE_CHUNKS * CHUNKSIZE; i += 64) {
+      (void)((volatile char*)dest)[i];
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    size_t ns = (end.tv_sec - start.tv_sec) * 1000000000 + end.tv_nsec - start.tv_nsec;
+    if (ns < best) best = ns;
+  }
+  return best;
+}
+
+/**
+ * Use a streaming copy loop for eager copies if it copies chunks faster than memcpy on this
+ * machine. If memory for the measurement can't be had, memcpy stays.
+ *
+ * \param copy  The streaming copy loop
+ * \param name  Its name, for chunk_copy_eager_engine
+ */
+void calibrate_eager_copy(void* (*copy)(void*, const void*, size_t), const char* name) {
+  size_t len = 2 * CALIBRATE_CHUNKS * CHUNKSIZE;
+  char* mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  if (mem == MAP_FAILED) return;
+  memset(mem, 1, len);
+  char* src = mem;
+  char* dest = mem + CALIBRATE_CHUNKS * CHUNKSIZE;
+
+  // Take turns so both loops see the machine in the same state
+  size_t memcpy_ns = SIZE_MAX;
+  size_t copy_ns = SIZE_MAX;
+  for (int round = 0; round < 2; round++) {
+    size_t ns = time_eager_copy(memcpy, src, dest);
+    if (ns < memcpy_ns) memcpy_ns = ns;
+    ns = time_eager_copy(copy, src, dest);
+    if (ns < copy_ns) copy_ns = ns;
+  }
+  munmap(mem, len);
+
+  if (copy_ns * (100 + CALIBRATE_MARGIN) < memcpy_ns * 100) {
+    eager_copy = copy;
+    eager_copy_name = name;
   }
-  //copying data from temp to new page
-  if (memcpy(pages[i], temp, CHUNKSIZE) < 0) perror("memcpy Failed");
-  free(temp);
 }
 
 /**
  * Setting up seg fault handler
  */
 void chunk_startup() {
+  page_size = sysconf(_SC_PAGESIZE);
+
+  // Use the widest streaming copy this CPU can run, but only if it beats memcpy here
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    calibrate_eager_copy(copy_avx512, "avx512");
+  } else if (__builtin_cpu_supports("avx2")) {
+    calibrate_eager_copy(copy_avx2, "avx2");
+  }
+#endif
+
   struct sigaction sa;
   memset(&sa, 0, sizeof(struct sigaction));
   sa.sa_sigaction = seg_fault_remap;
@@ -74,25 +560,87 @@ void chunk_startup() {
  * copied
  */
 void* chunk_alloc() {
-  // Call mmap to request a new chunk of memory. See comments below for description of arguments.
-  void* result = mmap(NULL, CHUNKSIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_SHARED, -1, 0);
-  // Arguments:
-  //   NULL: this is the address we'd like to map at. By passing null, we're asking the OS to
-  //   decide. CHUNKSIZE: This is the size of the new mapping in bytes. PROT_READ | PROT_WRITE: This
-  //   makes the new reading readable and writable MAP_ANONYMOUS | MAP_SHARED: This mapes a new
-  //   mapping to cleared memory instead of a file,
-  //                               which is another use for mmap. MAP_SHARED makes it possible for
-  //                               us to create shared mappings to the same memory.
-  //   -1: We're not connecting this memory to a file, so we pass -1 here.
-  //   0: This doesn't matter. It would be the offset into a file, but we aren't using one.
-
-  // Check for an error
-  if (result == MAP_FAILED) {
-    perror("mmap failed in chunk_alloc");
-    exit(2);
+  // Reuse a freed chunk if there is one
+  if (num_free_chunks > 0) {
+    num_free_chunks--;
+    return free_chunks[num_free_chunks];
+  }
+
+  // Otherwise take the next chunk from the pool, reserving more room for chunks if it is used up
+  if (pool_next == pool_end) {
+    // Call mmap to request memory for many chunks. See comments below for description of arguments.
+    pool_next = mmap(NULL, POOL_CHUNKS * CHUNKSIZE, PROT_READ | PROT_WRITE,
+                     MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+    // Arguments:
+    //   NULL: this is the address we'd like to map at. By passing null, we're asking the OS to
+    //   decide. POOL_CHUNKS * CHUNKSIZE: This is the size of the new mapping in bytes. Memory is
+    //   only used once a page is touched, so reserving many chunks at once costs nothing extra.
+    //   PROT_READ | PROT_WRITE: This makes the new reading readable and writable
+    //   MAP_ANONYMOUS | MAP_SHARED: This mapes a new mapping to cleared memory instead of a file,
+    //                               which is another use for mmap. MAP_SHARED makes it possible for
+    //                               us to create shared mappings to the same memory.
+    //   -1: We're not connecting this memory to a file, so we pass -1 here.
+    //   0: This doesn't matter. It would be the offset into a file, but we aren't using one.
+
+    // Check for an error
+    if (pool_next == MAP_FAILED) {
+      perror("mmap failed in chunk_alloc");
+      exit(2);
+    }
+    pool_end = pool_next + POOL_CHUNKS * CHUNKSIZE;
   }
 
   // Everything is okay. Return the pointer.
+  void* result = pool_next;
+  pool_next += CHUNKSIZE;
+  return result;
+}
+
+/**
+ * Return a chunk to the chunk pool so chunk_alloc can hand it out again.
+ *
+ * \param chunk  A chunk returned from chunk_alloc(), chunk_copy_eager() or chunk_copy_lazy()
+ */
+void chunk_free(void* chunk) {
+  // Forget any lazy copy of this chunk. Its peer stays read-only and copies itself when written.
+  lazy_region_t* r = region_find((intptr_t)chunk);
+  if (r != NULL) region_remove(r);
+
+  // The chunk may still share memory with a lazy copy, so give it fresh zeroed memory instead of
+  // clearing what it maps now.
+  if (mmap(chunk, CHUNKSIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_SHARED | MAP_FIXED, -1,
+           0) == MAP_FAILED) {
+    perror("mmap failed in chunk_free");
+    exit(2);
+  }
+
+  // pushing the chunk on the free stack, making room if necessary
+  if (num_free_chunks == max_free_chunks) {
+    max_free_chunks += 64;
+    free_chunks = realloc(free_chunks, sizeof(void*) * max_free_chunks);
+    if (free_chunks == NULL) {
+      perror("realloc failed");
+      exit(2);
+    }
+  }
+  free_chunks[num_free_chunks++] = chunk;
+}
+
+/**
+ * Allocate a region of memory that can be copied lazily with lazy_copy_range.
+ *
+ * \param len  The size of the region in bytes. This is rounded up to a multiple of the page size.
+ * \returns a pointer to the beginning of the new region
+ */
+void* range_alloc(size_t len) {
+  len = (len + page_size - 1) & ~(page_size - 1);
+
+  // This is the same kind of mapping chunk_alloc makes, just with a different size
+  void* result = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+  if (result == MAP_FAILED) {
+    perror("mmap failed in range_alloc");
+    exit(2);
+  }
   return result;
 }
 
@@ -104,16 +652,108 @@ void* chunk_alloc() {
  *   the original chunk.
  */
 void* chunk_copy_eager(void* chunk) {
-  // First, we'll allocate a new chunk to copy to
+  // First, we'll allocate a new chunk to copy to. Populating it fills in the whole chunk with one
+  // system call, instead of taking a page fault on every page the copy touches.
   void* new_chunk = chunk_alloc();
+  madvise(new_chunk, CHUNKSIZE, MADV_POPULATE_WRITE);
 
   // Now copy the data
-  if (memcpy(new_chunk, chunk, CHUNKSIZE) < 0) perror("memcpy Failed");
+  eager_copy(new_chunk, chunk, CHUNKSIZE);
 
   // Return the new chunk
   return new_chunk;
 }
 
+/**
+ * Get the name of the copy loop chunk_copy_eager uses on this CPU.
+ *
+ * \returns "avx512", "avx2" or "memcpy"
+ */
+const char* chunk_copy_eager_engine() {
+  return eager_copy_name;
+}
+
+/**
+ * Lazily copy len bytes at addr. Both sides become read-only, and a write to either side makes
+ * granule bytes around the write writable again.
+ *
+ * \param addr     The start of the memory to copy. Must be page aligned and shared.
+ * \param dest     Where to put the copy, or NULL to let the OS decide
+ * \param len      The number of bytes to copy
+ * \param granule  How many bytes a single write fault copies
+ * \returns a pointer to the copy
+ */
+void* lazy_copy(void* addr, void* dest, size_t len, size_t granule) {
+  size_t num_pages = len / page_size;
+
+  // If addr was lazily copied before, pages that were written since are separate mappings now.
+  // mremap can only duplicate one mapping at a time, so we need to know where they are.
+  size_t split_bytes = (num_pages + 7) / 8;
+  uint8_t* split = calloc(split_bytes, 1);
+  if (split == NULL) {
+    perror("calloc failed");
+    exit(2);
+  }
+  bool has_split = false;
+  lazy_region_t* previous = region_find((intptr_t)addr);
+  if (previous != NULL && previous->start == (intptr_t)addr && previous->size == len) {
+    memcpy(split, previous->split, split_bytes);
+    for (size_t i = 0; i < split_bytes; i++) {
+      if (split[i] != 0) has_split = true;
+    }
+  }
+
+  // making the original read only first, so the new mappings below start out read only too
+  if (mprotect(addr, len, PROT_READ) == -1) {
+    perror("mprotect failed");
+    exit(2);
+  }
+
+  // Split memory has to be copied piece by piece, so reserve space for all the pieces first
+  if (has_split && dest == NULL) {
+    dest = mmap(NULL, len, PROT_NONE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    if (dest == MAP_FAILED) {
+      perror("mmap failed");
+      exit(2);
+    }
+  }
+
+  //pointing the copy to the old memory (laziness), one mapping at a time
+  void* result = NULL;
+  if (dest == NULL) {
+    result = mremap(addr, 0, len, MREMAP_MAYMOVE);
+  } else {
+    size_t start = 0;
+    while (start < num_pages) {
+      // a page of its own is copied alone, otherwise copy up to the next page of its own
+      size_t end = start + 1;
+      if (!bit_test(split, start)) {
+        while (end < num_pages && !bit_test(split, end)) end++;
+      }
+      void* piece = (char*)dest + start * page_size;
+      result = mremap((char*)addr + start * page_size, 0, (end - start) * page_size,
+                      MREMAP_FIXED | MREMAP_MAYMOVE, piece);
+      if (result == MAP_FAILED) break;
+      start = end;
+    }
+    if (result != MAP_FAILED) result = dest;
+  }
+  //checking mremap works
+  if (result == MAP_FAILED) {
+    perror("mremap failed");
+    exit(2);
+  }
+
+  // recording both sides so the seg fault handler can find them later
+  lazy_region_t* original = region_add((intptr_t)addr, len, granule, split);
+  lazy_region_t* copy = region_add((intptr_t)result, len, granule, split);
+  original->peer = copy;
+  copy->peer = original;
+  free(split);
+
+  return result;
+}
+
 /**
  * Create a copy of a chunk by copying values lazily.
  *
@@ -122,65 +762,518 @@ void* chunk_copy_eager(void* chunk) {
  *   the original chunk.
  */
 void* chunk_copy_lazy(void* chunk) {
-  // Just to make sure your code works, this implementation currently calls the eager copy version
-  // return chunk_copy_eager(chunk);
-
-  // Your implementation should do the following:
-  // 1. Use mremap to create a duplicate mapping of the chunk passed in
-  // 2. Mark both mappings as read-only
-  // 3. Keep some record of both lazy copies so you can make them writable later.
-  //    At a minimum, you'll need to know where the chunk begins and ends.
-  // printf("1\n");
-  // printf("%d, %d", num_pages, max_pages);
-  // checking if we have room in our page array for the new pages
-  if (num_pages >= max_pages - 2) {
-    max_pages += 64;
-    // increasing size of page array if necessary by addding 64 new spots in array
-    pages = realloc(pages, sizeof(void*) * max_pages);
-    int j = 0;
-    //zeroing out new pages
-    for (j = 0; j < 64; j++) {
-      pages[max_pages - j - 1] = 0;
-    }
-  }
-  //getting virtual address for copy
-  void* new_chunk = chunk_alloc();
-  //pointing new chunk to old memory (laziness)
-  void* result = mremap(chunk, 0, CHUNKSIZE, MREMAP_FIXED | MREMAP_MAYMOVE, new_chunk);
-  //checking mremap works
-  if (result == MAP_FAILED) {
-    perror("mmap failed");
+  // A write to either chunk copies the whole chunk. The copy goes in a chunk from the pool, so
+  // mremap is the only system call needed to place it.
+  return lazy_copy(chunk, chunk_alloc(), CHUNKSIZE, CHUNKSIZE);
+}
+
+/**
+ * Create a copy of a page-aligned range by copying values lazily. This takes about the same time
+ * no matter how large the range is, and a write to either side only copies the page written.
+ *
+ * \param addr  The start of the range. Must be page aligned and inside memory returned by
+ *              chunk_alloc() or range_alloc().
+ * \param len   The length of the range in bytes. Must be a multiple of the page size.
+ * \returns a pointer to the beginning of the copy
+ */
+void* lazy_copy_range(void* addr, size_t len) {
+  if ((intptr_t)addr % page_size != 0 || len % page_size != 0 || len == 0) {
+    fprintf(stderr, "lazy_copy_range needs a page aligned range\n");
     exit(2);
   }
-  // making the old chunk read only
-  int result1 = mprotect(chunk, CHUNKSIZE, PROT_READ);
-  //checking it worked
-  if (result1 == -1) {
-    perror("mprotect1 failed");
+  return lazy_copy(addr, NULL, len, page_size);
+}
+
+/**
+ * Check whether the page holding addr has been written since it was lazily copied.
+ *
+ * \param addr  Any address inside a lazily copied range or chunk
+ * \returns true if the page was written, false if it still shares memory with its copy
+ */
+bool lazy_page_dirty(void* addr) {
+  lazy_region_t* r = region_find((intptr_t)addr);
+  if (r == NULL) return false;
+  return bit_test(r->dirty, ((intptr_t)addr - r->start) / r->granule);
+}
+
+/**
+ * List the pages of a lazily copied range that have been written since the copy was made.
+ *
+ * \param range  The start of either side of a lazy copy
+ * \param pages  Page indices of the dirty pages are written here
+ * \param max    The number of indices pages has room for
+ * \returns the number of dirty pages, which may be larger than max
+ */
+size_t lazy_dirty_pages(void* range, size_t* pages, size_t max) {
+  lazy_region_t* r = region_find((intptr_t)range);
+  if (r == NULL || r->start != (intptr_t)range) return 0;
+
+  size_t count = 0;
+  size_t per_granule = r->granule / page_size;
+  for (size_t i = 0; i < r->size / r->granule; i++) {
+    if (r->dirty[i / 8] == 0) {
+      // skip over eight clean granules at a time
+      i += 7;
+      continue;
+    }
+    if (bit_test(r->dirty, i)) {
+      for (size_t j = 0; j < per_granule; j++) {
+        if (count < max) pages[count] = i * per_granule + j;
+        count++;
+      }
+    }
+  }
+  return count;
+}
+
+/**
+ * Clear the soft-dirty bit on every page in this process, so the kernel write-protects the pages
+ * and sets the bit again on the next write to each page. This does not send us any signals.
+ */
+void soft_dirty_clear() {
+  if (pwrite(clear_refs_fd, "4", 1, 0) != 1) {
+    perror("clearing soft-dirty bits failed");
     exit(2);
   }
-  //making the new chunk read only
-  int result2 = mprotect(new_chunk, CHUNKSIZE, PROT_READ);
-  //error checking
-  if (result2 == -1) {
-    perror("mprotect2 failed");
+}
+
+/**
+ * Find the pages written since the last soft_dirty_clear with one pass over the page tables. This
+ * uses the PAGEMAP_SCAN ioctl where the kernel has it, and reads pagemap entries otherwise.
+ *
+ * \param addr   The page-aligned start of the memory to scan
+ * \param len    The number of bytes to scan
+ * \param pages  Page indices (relative to addr) of the written pages are written here
+ * \param max    The number of indices pages has room for
+ * \returns the number of written pages, which may be larger than max
+ */
+size_t soft_dirty_scan(void* addr, size_t len, size_t* pages, size_t max) {
+  size_t count = 0;
+  intptr_t start = (intptr_t)addr;
+  intptr_t end = start + len;
+
+  if (has_pagemap_scan) {
+    // The kernel hands back runs of soft-dirty pages, so clean memory costs nothing to report
+    struct page_region found[SCAN_BATCH];
+    struct pm_scan_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.size = sizeof(arg);
+    arg.start = start;
+    arg.end = end;
+    arg.vec = (intptr_t)found;
+    arg.vec_len = SCAN_BATCH;
+    arg.category_mask = PAGE_IS_SOFT_DIRTY;
+    arg.return_mask = PAGE_IS_SOFT_DIRTY;
+
+    while (arg.start < arg.end) {
+      int n = ioctl(pagemap_fd, PAGEMAP_SCAN, &arg);
+      if (n == -1) break;
+      for (int i = 0; i < n; i++) {
+        for (intptr_t p = found[i].start; p < (intptr_t)found[i].end; p += page_size) {
+          if (count < max) pages[count] = (p - start) / page_size;
+          count++;
+        }
+      }
+      arg.start = arg.walk_end;
+    }
+    if (arg.start >= arg.end) return count;
+
+    // Fall through to reading pagemap if this kernel does not know the ioctl
+    has_pagemap_scan = false;
+    count = 0;
+  }
+
+  uint64_t entries[SCAN_BATCH];
+  size_t num_pages = len / page_size;
+  for (size_t first = 0; first < num_pages; first += SCAN_BATCH) {
+    size_t n = num_pages - first < SCAN_BATCH ? num_pages - first : SCAN_BATCH;
+    off_t offset = (start / page_size + first) * sizeof(uint64_t);
+    if (pread(pagemap_fd, entries, n * sizeof(uint64_t), offset) != n * sizeof(uint64_t)) {
+      perror("reading pagemap failed");
+      exit(2);
+    }
+    for (size_t i = 0; i < n; i++) {
+      if (entries[i] & PAGEMAP_SOFT_DIRTY) {
+        if (count < max) pages[count] = first + i;
+        count++;
+      }
+    }
+  }
+  return count;
+}
+
+/**
+ * Choose how checkpoints taken from now on find the pages written after them.
+ *
+ * CHECKPOINT_FAULT (the default) lazily copies the chunks and catches the first write to each page
+ * with a seg fault, which also keeps a snapshot of the old contents. CHECKPOINT_SCAN lets the
+ * kernel track writes with soft-dirty bits and finds them with one page table scan when asked,
+ * so writes never cause a signal, but there are no snapshots. Soft-dirty bits are shared by the
+ * whole process, so taking a scan checkpoint restarts tracking for every other scan checkpoint.
+ *
+ * \param mode  The new mode
+ * \returns true if the mode is supported. Kernels built without soft-dirty support cannot scan.
+ */
+bool checkpoint_set_mode(checkpoint_mode_t mode) {
+  if (mode == CHECKPOINT_SCAN) {
+    if (pagemap_fd == -1) pagemap_fd = open("/proc/self/pagemap", O_RDONLY);
+    if (clear_refs_fd == -1) clear_refs_fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (pagemap_fd == -1 || clear_refs_fd == -1) return false;
+
+    // Write to a page after clearing the bits and make sure the kernel noticed
+    char* probe = range_alloc(page_size);
+    soft_dirty_clear();
+    probe[0] = 1;
+    size_t page;
+    size_t found = soft_dirty_scan(probe, page_size, &page, 1);
+    munmap(probe, page_size);
+    if (found != 1) return false;
+  }
+  checkpoint_mode = mode;
+  return true;
+}
+
+/**
+ * Take a checkpoint of a set of chunks. Each chunk is lazily copied one page at a time, so this is
+ * cheap, and the application can keep writing to the chunks afterwards. Writes after this point
+ * are recorded and can be listed with checkpoint_dirty or saved with checkpoint_write.
+ *
+ * The record of writes lives with the chunk's lazy copy, and a new copy would start it over. So in
+ * CHECKPOINT_FAULT mode a chunk can only be in one live checkpoint at a time.
+ *
+ * \param chunks      An array of chunks returned from chunk_alloc()
+ * \param num_chunks  The number of chunks in the array
+ * \returns a new checkpoint, or NULL if a chunk is already in a live CHECKPOINT_FAULT checkpoint
+ *   (or appears twice). Release it with checkpoint_release.
+ */
+checkpoint_t* checkpoint_take(void** chunks, size_t num_chunks) {
+  checkpoint_t* cp = malloc(sizeof(checkpoint_t));
+  void** chunks_copy = malloc(sizeof(void*) * num_chunks);
+  void** snapshots = malloc(sizeof(void*) * num_chunks);
+  if (cp == NULL || chunks_copy == NULL || snapshots == NULL) {
+    perror("malloc failed");
     exit(2);
   }
-  //finding spot to put the new and old address in our array
-  int i = num_pages;
-  //placing old chunk and incrementing i
-  pages[i++] = chunk;
-  //placing new chunk
-  pages[i] = new_chunk;
-  if ((intptr_t)new_chunk < 0) {
-    perror("errno");
-    exit(1);
+  cp->mode = checkpoint_mode;
+  cp->num_chunks = num_chunks;
+  cp->chunks = chunks_copy;
+  cp->snapshots = snapshots;
+
+  for (size_t i = 0; i < num_chunks; i++) {
+    cp->chunks[i] = chunks[i];
+    cp->snapshots[i] = NULL;
+    if (cp->mode == CHECKPOINT_FAULT) {
+      // Copying the chunk again would throw away what the other checkpoint recorded. Undo the
+      // chunks copied so far instead.
+      lazy_region_t* r = region_find((intptr_t)chunks[i]);
+      if (r != NULL && r->checkpoint != NULL) {
+        cp->num_chunks = i;
+        checkpoint_release(cp);
+        return NULL;
+      }
+      cp->snapshots[i] = lazy_copy(chunks[i], NULL, CHUNKSIZE, page_size);
+      region_find((intptr_t)chunks[i])->checkpoint = cp;
+    }
   }
-  num_pages += 2;
 
-  return new_chunk;
-  // Later, if either copy is written to you will need to:
-  // 1. Save the contents of the chunk elsewhere (a local array works well)
-  // 2. Use mmap to make a writable mapping at the location of the chunk that was written
-  // 3. Restore the contents of the chunk to the new writable mapping
+  // In scan mode a single system call starts tracking every page
+  if (cp->mode == CHECKPOINT_SCAN) soft_dirty_clear();
+  return cp;
+}
+
+/**
+ * Get the snapshot of one chunk in a checkpoint. The snapshot is read-only and holds the contents
+ * the chunk had when the checkpoint was taken.
+ *
+ * \param cp     The checkpoint
+ * \param index  Which chunk to get, in the order they were passed to checkpoint_take
+ * \returns a pointer to the read-only snapshot, or NULL if the checkpoint was taken in
+ *   CHECKPOINT_SCAN mode
+ */
+const void* checkpoint_snapshot(checkpoint_t* cp, size_t index) {
+  return cp->snapshots[index];
+}
+
+/**
+ * List the pages that have been written since a checkpoint was taken.
+ *
+ * \param cp     The checkpoint
+ * \param pages  The chunk and page index of every dirty page is written here
+ * \param max    The number of entries pages has room for
+ * \returns the number of dirty pages, which may be larger than max
+ */
+size_t checkpoint_dirty(checkpoint_t* cp, checkpoint_page_t* pages, size_t max) {
+  size_t per_chunk = CHUNKSIZE / page_size;
+  size_t indices[per_chunk];
+  size_t count = 0;
+  for (size_t i = 0; i < cp->num_chunks; i++) {
+    size_t n;
+    if (cp->mode == CHECKPOINT_SCAN) {
+      n = soft_dirty_scan(cp->chunks[i], CHUNKSIZE, indices, per_chunk);
+    } else {
+      n = lazy_dirty_pages(cp->chunks[i], indices, per_chunk);
+    }
+    for (size_t j = 0; j < n; j++) {
+      if (count < max) {
+        pages[count].chunk = i;
+        pages[count].page = indices[j];
+      }
+      count++;
+    }
+  }
+  return count;
+}
+
+/**
+ * Write the pages that have been written since a checkpoint was taken to a file. Each page is
+ * written as a checkpoint_page_t header followed by the current contents of the page. The
+ * application should not write to the chunks while this runs.
+ *
+ * \param cp  The checkpoint
+ * \param fd  An open file descriptor to write to
+ * \returns the number of pages written, or -1 if writing failed
+ */
+ssize_t checkpoint_write(checkpoint_t* cp, int fd) {
+  size_t count = checkpoint_dirty(cp, NULL, 0);
+  checkpoint_page_t* pages = malloc(sizeof(checkpoint_page_t) * count);
+  if (count > 0 && pages == NULL) {
+    perror("malloc failed");
+    exit(2);
+  }
+  checkpoint_dirty(cp, pages, count);
+
+  // Write headers and pages in batches so each page does not need its own system call
+  struct iovec iov[IOV_MAX];
+  size_t i = 0;
+  while (i < count) {
+    int n = 0;
+    size_t bytes = 0;
+    while (i < count && n + 2 <= IOV_MAX) {
+      iov[n].iov_base = &pages[i];
+      iov[n].iov_len = sizeof(checkpoint_page_t);
+      iov[n + 1].iov_base = (char*)cp->chunks[pages[i].chunk] + pages[i].page * page_size;
+      iov[n + 1].iov_len = page_size;
+      bytes += sizeof(checkpoint_page_t) + page_size;
+      n += 2;
+      i++;
+    }
+
+    // writev may write less than asked, so keep going until the whole batch is out
+    struct iovec* next = iov;
+    while (bytes > 0) {
+      ssize_t rc = writev(fd, next, n);
+      if (rc == -1) {
+        perror("writev failed");
+        free(pages);
+        return -1;
+      }
+      bytes -= rc;
+      while (n > 0 && (size_t)rc >= next->iov_len) {
+        rc -= next->iov_len;
+        next++;
+        n--;
+      }
+      if (n > 0) {
+        next->iov_base = (char*)next->iov_base + rc;
+        next->iov_len -= rc;
+      }
+    }
+  }
+
+  free(pages);
+  return count;
+}
+
+/**
+ * Release a checkpoint and its snapshots. The chunks stay read-only until they are written, since
+ * they may still share memory with lazy copies made before the checkpoint.
+ *
+ * \param cp  The checkpoint to release
+ */
+void checkpoint_release(checkpoint_t* cp) {
+  for (size_t i = 0; i < cp->num_chunks && cp->mode == CHECKPOINT_FAULT; i++) {
+    lazy_region_t* r = region_find((intptr_t)cp->chunks[i]);
+    if (r != NULL && r->checkpoint == cp) r->checkpoint = NULL;
+    r = region_find((intptr_t)cp->snapshots[i]);
+    if (r != NULL) region_remove(r);
+    if (munmap(cp->snapshots[i], CHUNKSIZE) == -1) {
+      perror("munmap failed");
+      exit(2);
+    }
+  }
+  free(cp->chunks);
+  free(cp->snapshots);
+  free(cp);
+}
+
+/**
+ * Copy a file into memory without reading it. The file is mapped copy-on-write, so pages are only
+ * read from the file when they are used, and writing to the copy never changes the file. This
+ * costs page table setup instead of a read of the whole file.
+ *
+ * \param path  The file to copy
+ * \param len   The length of the file is written here
+ * \returns a pointer to the copy, or NULL if the file could not be mapped
+ */
+void* file_copy_lazy(const char* path, size_t* len) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    perror("open failed in file_copy_lazy");
+    return NULL;
+  }
+  struct stat info;
+  if (fstat(fd, &info) == -1) {
+    perror("fstat failed in file_copy_lazy");
+    close(fd);
+    return NULL;
+  }
+  if (info.st_size == 0) {
+    fprintf(stderr, "file_copy_lazy can't map an empty file\n");
+    close(fd);
+    return NULL;
+  }
+
+  // MAP_PRIVATE makes the kernel do the copy-on-write for us, one page at a time
+  void* copy = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (copy == MAP_FAILED) {
+    perror("mmap failed in file_copy_lazy");
+    close(fd);
+    return NULL;
+  }
+  file_copy_t* fc = malloc(sizeof(file_copy_t));
+  if (fc == NULL) {
+    perror("malloc failed");
+    exit(2);
+  }
+  fc->addr = copy;
+  fc->len = info.st_size;
+  fc->fd = fd;
+  fc->next = file_copies;
+  file_copies = fc;
+
+  *len = info.st_size;
+  return copy;
+}
+
+// find the record for a file copy, or NULL if copy did not come from file_copy_lazy
+file_copy_t* file_copy_find(void* copy) {
+  for (file_copy_t* fc = file_copies; fc != NULL; fc = fc->next) {
+    if (fc->addr == copy) return fc;
+  }
+  return NULL;
+}
+
+/**
+ * Write pages [first, last) of a file copy to out, either from memory or by asking the kernel to
+ * copy the data straight from the original file.
+ *
+ * \param fc        The file copy
+ * \param out       The file to write to
+ * \param first     The first page to write
+ * \param last      One past the last page to write
+ * \param modified  true if these pages were written in memory, false if they match the file
+ * \returns 0 on success, -1 on failure
+ */
+int file_copy_run(file_copy_t* fc, int out, size_t first, size_t last, bool modified) {
+  off_t offset = first * page_size;
+  size_t end = last * page_size < fc->len ? last * page_size : fc->len;
+
+  // Unmodified data goes through copy_file_range, so filesystems that support reflinks can share
+  // the blocks instead of copying them, and others copy inside the kernel
+  while (!modified && offset < end) {
+    off_t in_offset = offset;
+    ssize_t rc = copy_file_range(fc->fd, &in_offset, out, &offset, end - offset, 0);
+    if (rc == -1 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+      // This pair of files can't be copied in the kernel. Write from memory below instead.
+      modified = true;
+    } else if (rc <= 0) {
+      perror("copy_file_range failed");
+      return -1;
+    }
+  }
+
+  // Modified data has to be written from memory
+  while (offset < end) {
+    ssize_t rc = pwrite(out, (char*)fc->addr + offset, end - offset, offset);
+    if (rc == -1) {
+      perror("pwrite failed");
+      return -1;
+    }
+    offset += rc;
+  }
+  return 0;
+}
+
+/**
+ * Save a file copy to a new file. Pages that were never written are copied from the original file
+ * by the kernel, and only pages written in memory are written out from the copy.
+ *
+ * \param copy  A copy returned from file_copy_lazy()
+ * \param path  Where to save the copy. This file is created or replaced.
+ * \returns 0 on success, -1 on failure
+ */
+int file_copy_save(void* copy, const char* path) {
+  file_copy_t* fc = file_copy_find(copy);
+  if (fc == NULL) {
+    fprintf(stderr, "file_copy_save needs a copy from file_copy_lazy\n");
+    return -1;
+  }
+  if (pagemap_fd == -1) pagemap_fd = open("/proc/self/pagemap", O_RDONLY);
+  int out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (pagemap_fd == -1 || out == -1 || ftruncate(out, fc->len) == -1) {
+    perror("opening files failed in file_copy_save");
+    if (out != -1) close(out);
+    return -1;
+  }
+
+  // A page was written if the kernel replaced the file page with an anonymous one, which is either
+  // in memory without the file bit or out in swap. Pages not in memory were never written.
+  uint64_t entries[SCAN_BATCH];
+  size_t num_pages = (fc->len + page_size - 1) / page_size;
+  size_t run_start = 0;
+  bool run_modified = false;
+  int rc = 0;
+  for (size_t first = 0; first < num_pages && rc == 0; first += SCAN_BATCH) {
+    size_t n = num_pages - first < SCAN_BATCH ? num_pages - first : SCAN_BATCH;
+    off_t offset = ((intptr_t)fc->addr / page_size + first) * sizeof(uint64_t);
+    if (pread(pagemap_fd, entries, n * sizeof(uint64_t), offset) != n * sizeof(uint64_t)) {
+      perror("reading pagemap failed");
+      rc = -1;
+      break;
+    }
+    for (size_t i = 0; i < n && rc == 0; i++) {
+      bool modified = (entries[i] & PAGEMAP_SWAPPED) ||
+                      ((entries[i] & PAGEMAP_PRESENT) && !(entries[i] & PAGEMAP_FILE));
+      // write out the run of pages so far when this page is different
+      if (modified != run_modified && first + i > run_start) {
+        rc = file_copy_run(fc, out, run_start, first + i, run_modified);
+        run_start = first + i;
+      }
+      run_modified = modified;
+    }
+  }
+  if (rc == 0) rc = file_copy_run(fc, out, run_start, num_pages, run_modified);
+
+  if (close(out) == -1) {
+    perror("close failed in file_copy_save");
+    rc = -1;
+  }
+  return rc;
+}
+
+/**
+ * Throw away a file copy. The original file is not changed.
+ *
+ * \param copy  A copy returned from file_copy_lazy()
+ */
+void file_copy_free(void* copy) {
+  file_copy_t** link = &file_copies;
+  while (*link != NULL && (*link)->addr != copy) link = &(*link)->next;
+  file_copy_t* fc = *link;
+  if (fc == NULL) return;
+
+  *link = fc->next;
+  munmap(fc->addr, fc->len);
+  close(fc->fd);
+  free(fc);
 }
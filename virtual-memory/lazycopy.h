@@ -1,6 +1,10 @@
 #ifndef LAZYCOPY_H
 #define LAZYCOPY_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
 // This defines the size of a chunk of data we can request or copy. Must be a multiple of page size.
 #define CHUNKSIZE 0x10000
 
@@ -10,10 +14,80 @@ void chunk_startup();
 // This function should return a new chunk of memory for use
 void* chunk_alloc();
 
+// This function returns a chunk to the pool chunk_alloc hands chunks out from
+void chunk_free(void* chunk);
+
 // This function should return a copy of a chunk created with eager (normal) copying
 void* chunk_copy_eager(void* chunk);
 
+// This function returns the name of the copy loop chunk_copy_eager picked for this CPU
+const char* chunk_copy_eager_engine();
+
 // This function should return a copy of a chunk created with lazy copying
 void* chunk_copy_lazy(void* chunk);
 
+// This function returns new memory of len bytes (rounded up to whole pages) for lazy_copy_range
+void* range_alloc(size_t len);
+
+// This function lazily copies a page-aligned range of memory from chunk_alloc or range_alloc.
+// Writes to either side only copy the page that was written.
+void* lazy_copy_range(void* addr, size_t len);
+
+// This function sets how many lazily copied chunks to copy ahead of writes with a regular stride.
+// It is off (0) by default.
+size_t lazy_set_fault_ahead(size_t chunks);
+
+// This function returns how many write faults lazy copies have taken
+size_t lazy_fault_count();
+
+// This function returns true if the page holding addr was written since it was lazily copied
+bool lazy_page_dirty(void* addr);
+
+// This function lists the dirty pages of one side of a lazy copy and returns how many there are
+size_t lazy_dirty_pages(void* range, size_t* pages, size_t max);
+
+// A checkpoint of a set of chunks, created by checkpoint_take
+typedef struct checkpoint checkpoint_t;
+
+// The ways a checkpoint can find pages written after it was taken
+typedef enum checkpoint_mode {
+  CHECKPOINT_FAULT,  // write-protect the chunks and catch the first write to each page
+  CHECKPOINT_SCAN,   // let the kernel set soft-dirty bits and scan the page tables when asked
+} checkpoint_mode_t;
+
+// One page written since a checkpoint was taken
+typedef struct checkpoint_page {
+  size_t chunk;  // index of the chunk in the checkpoint
+  size_t page;   // index of the page within the chunk
+} checkpoint_page_t;
+
+// This function sets the mode for new checkpoints and returns false if the kernel can't support it
+bool checkpoint_set_mode(checkpoint_mode_t mode);
+
+// This function takes a lazy snapshot of num_chunks chunks and starts recording writes to them.
+// In CHECKPOINT_FAULT mode a chunk can be in only one live checkpoint, and this returns NULL if a
+// chunk already is. Release the older checkpoint first.
+checkpoint_t* checkpoint_take(void** chunks, size_t num_chunks);
+
+// This function returns the read-only snapshot of chunk index in a checkpoint
+const void* checkpoint_snapshot(checkpoint_t* cp, size_t index);
+
+// This function lists the pages written since the checkpoint and returns how many there are
+size_t checkpoint_dirty(checkpoint_t* cp, checkpoint_page_t* pages, size_t max);
+
+// This function writes only the pages written since the checkpoint to fd
+ssize_t checkpoint_write(checkpoint_t* cp, int fd);
+
+// This function frees a checkpoint and its snapshots
+void checkpoint_release(checkpoint_t* cp);
+
+// This function copies a file into memory copy-on-write, without reading it
+void* file_copy_lazy(const char* path, size_t* len);
+
+// This function saves a file copy to path, copying unwritten pages from the original file
+int file_copy_save(void* copy, const char* path);
+
+// This function throws away a file copy
+void file_copy_free(void* copy);
+
 #endif
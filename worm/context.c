@@ -0,0 +1,163 @@
+#define _XOPEN_SOURCE
+#define _XOPEN_SOURCE_EXTENDED
+
+#include "context.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef USE_UCONTEXT
+
+/**
+ * Set up a context that starts running a function on a new stack the first time it is
+ * switched to. The function must never return.
+ *
+ * \param context  The context to set up
+ * \param stack    The lowest address of the stack memory
+ * \param size     The size of the stack memory in bytes
+ * \param entry    The function the context starts in
+ */
+void context_init(context_t* context, void* stack, size_t size, void (*entry)()) {
+  // Start from a copy of the current context, then point it at the new stack and function
+  getcontext(&context->uc);
+  context->uc.uc_stack.ss_sp = stack;
+  context->uc.uc_stack.ss_size = size;
+  context->uc.uc_link = NULL;
+  makecontext(&context->uc, entry, 0);
+}
+
+/**
+ * Save the running context in one context and resume another.
+ *
+ * \param from  The running context is saved here
+ * \param to    The context to resume
+ */
+void context_switch(context_t* from, context_t* to) {
+  if (swapcontext(&from->uc, &to->uc) < 0) {
+    perror("swapcontext failed");
+    exit(2);
+  }
+}
+
+const char* context_engine() {
+  return "ucontext";
+}
+
+#else
+
+// Symbol names get a leading underscore on macOS, and ELF wants the type and size of functions
+#ifdef __APPLE__
+#define ASM_BEGIN(name) ".globl _" #name "\n.p2align 4\n_" #name ":\n"
+#define ASM_END(name)
+#else
+#define ASM_BEGIN(name) ".globl " #name "\n.type " #name ", %function\n.p2align 4\n" #name ":\n"
+#define ASM_END(name) ".size " #name ", .-" #name "\n"
+#endif
+
+#if defined(__x86_64__)
+
+// Push the callee-saved registers, swap stack pointers, pop the other context's registers, and
+// return to wherever that context called context_switch. The signal mask and floating point
+// control words are left alone, since every context shares them.
+__asm__(".text\n" ASM_BEGIN(context_switch)
+        "  pushq %rbp\n"
+        "  pushq %rbx\n"
+        "  pushq %r12\n"
+        "  pushq %r13\n"
+        "  pushq %r14\n"
+        "  pushq %r15\n"
+        "  movq %rsp, (%rdi)\n"
+        "  movq (%rsi), %rsp\n"
+        "  popq %r15\n"
+        "  popq %r14\n"
+        "  popq %r13\n"
+        "  popq %r12\n"
+        "  popq %rbx\n"
+        "  popq %rbp\n"
+        "  ret\n" ASM_END(context_switch));
+
+// The number of registers context_switch keeps on the stack
+#define SAVED_REGISTERS 6
+
+const char* context_engine() {
+  return "x86-64 assembly";
+}
+
+#elif defined(__aarch64__)
+
+// Store the callee-saved registers x19-x30 and d8-d15 on the stack, swap stack pointers, load
+// the other context's registers, and return through its saved link register
+__asm__(".text\n" ASM_BEGIN(context_switch)
+        "  sub sp, sp, #160\n"
+        "  stp x19, x20, [sp, #0]\n"
+        "  stp x21, x22, [sp, #16]\n"
+        "  stp x23, x24, [sp, #32]\n"
+        "  stp x25, x26, [sp, #48]\n"
+        "  stp x27, x28, [sp, #64]\n"
+        "  stp x29, x30, [sp, #80]\n"
+        "  stp d8, d9, [sp, #96]\n"
+        "  stp d10, d11, [sp, #112]\n"
+        "  stp d12, d13, [sp, #128]\n"
+        "  stp d14, d15, [sp, #144]\n"
+        "  mov x9, sp\n"
+        "  str x9, [x0]\n"
+        "  ldr x9, [x1]\n"
+        "  mov sp, x9\n"
+        "  ldp x19, x20, [sp, #0]\n"
+        "  ldp x21, x22, [sp, #16]\n"
+        "  ldp x23, x24, [sp, #32]\n"
+        "  ldp x25, x26, [sp, #48]\n"
+        "  ldp x27, x28, [sp, #64]\n"
+        "  ldp x29, x30, [sp, #80]\n"
+        "  ldp d8, d9, [sp, #96]\n"
+        "  ldp d10, d11, [sp, #112]\n"
+        "  ldp d12, d13, [sp, #128]\n"
+        "  ldp d14, d15, [sp, #144]\n"
+        "  add sp, sp, #160\n"
+        "  ret\n" ASM_END(context_switch));
+
+// The number of 8-byte slots context_switch keeps on the stack
+#define SAVED_REGISTERS 20
+
+// The slot holding x30, the link register that context_switch returns through
+#define LINK_REGISTER_SLOT 11
+
+const char* context_engine() {
+  return "aarch64 assembly";
+}
+
+#endif
+
+/**
+ * Set up a context that starts running a function on a new stack the first time it is
+ * switched to. The stack is laid out as if the context had called context_switch, with the
+ * entry function in place of its return address.
+ *
+ * \param context  The context to set up
+ * \param stack    The lowest address of the stack memory
+ * \param size     The size of the stack memory in bytes
+ * \param entry    The function the context starts in
+ */
+void context_init(context_t* context, void* stack, size_t size, void (*entry)()) {
+  // The ABIs on both CPUs want the stack aligned to 16 bytes
+  uintptr_t top = ((uintptr_t)stack + size) & ~(uintptr_t)15;
+
+#if defined(__x86_64__)
+  // Under the saved registers is the return address, which sends context_switch to entry. Below
+  // that is a fake return address for entry, so the stack is aligned as if entry had been called.
+  void** sp = (void**)top;
+  *--sp = NULL;
+  *--sp = (void*)entry;
+  for (int i = 0; i < SAVED_REGISTERS; i++) *--sp = NULL;
+#elif defined(__aarch64__)
+  // context_switch returns through the saved link register, so entry goes there
+  void** sp = (void**)top - SAVED_REGISTERS;
+  for (int i = 0; i < SAVED_REGISTERS; i++) sp[i] = NULL;
+  sp[LINK_REGISTER_SLOT] = (void*)entry;
+#endif
+
+  context->sp = sp;
+}
+
+#endif
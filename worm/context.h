@@ -0,0 +1,51 @@
+#ifndef CONTEXT_H
+#define CONTEXT_H
+
+#include <stddef.h>
+
+// Use hand-written context switches on CPUs that have them, unless USE_UCONTEXT is defined
+#if !defined(USE_UCONTEXT) && !defined(__x86_64__) && !defined(__aarch64__)
+#define USE_UCONTEXT
+#endif
+
+#ifdef USE_UCONTEXT
+#include <ucontext.h>
+#endif
+
+/// The saved state of a suspended execution context
+typedef struct context {
+#ifdef USE_UCONTEXT
+  ucontext_t uc;  //< Everything swapcontext saves, including the signal mask
+#else
+  void* sp;  //< The saved stack pointer. Callee-saved registers are stored on the stack.
+#endif
+} context_t;
+
+/**
+ * Set up a context that starts running a function on a new stack the first time it is
+ * switched to. The function must never return.
+ *
+ * \param context  The context to set up
+ * \param stack    The lowest address of the stack memory
+ * \param size     The size of the stack memory in bytes
+ * \param entry    The function the context starts in
+ */
+void context_init(context_t* context, void* stack, size_t size, void (*entry)());
+
+/**
+ * Save the running context in one context and resume another. This returns when some other
+ * context switches back to the one saved in from.
+ *
+ * \param from  The running context is saved here
+ * \param to    The context to resume
+ */
+void context_switch(context_t* from, context_t* to);
+
+/**
+ * Get the name of the context switch implementation, for reporting.
+ *
+ * \returns "x86-64 assembly", "aarch64 assembly", or "ucontext"
+ */
+const char* context_engine();
+
+#endif
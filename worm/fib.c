@@ -0,0 +1,89 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "scheduler.h"
+
+// The Fibonacci number to compute unless a different one is given on the command line
+#define DEFAULT_N 38
+
+// The call tree is cut this many levels down, and every subtree there becomes its own task
+#define SPLIT_DEPTH 10
+
+// Subproblems at the split depth
+int jobs[1 << SPLIT_DEPTH];
+int num_jobs = 0;
+
+// Get the time in nanoseconds from a clock that never jumps
+size_t time_ns() {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+    perror("clock_gettime");
+    exit(2);
+  }
+  return ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Compute a Fibonacci number the slow way, so there is plenty of work to spread out
+long fib(int n) {
+  if (n < 2) return n;
+  return fib(n - 1) + fib(n - 2);
+}
+
+// Record the subproblems fib(n) would call depth levels down. Their results add up to fib(n).
+void split(int n, int depth) {
+  if (depth == 0 || n < 2) {
+    jobs[num_jobs++] = n;
+  } else {
+    split(n - 1, depth - 1);
+    split(n - 2, depth - 1);
+  }
+}
+
+// Solve one subproblem. The argument and the result are both carried in the pointer.
+void* fib_task(void* arg) {
+  return (void*)(intptr_t)fib((intptr_t)arg);
+}
+
+int main(int argc, char** argv) {
+  if (argc > 3) {
+    fprintf(stderr, "Usage: %s [workers] [n]\n", argv[0]);
+    exit(1);
+  }
+  if (argc >= 2) scheduler_set_workers(atol(argv[1]));
+  int n = argc == 3 ? atoi(argv[2]) : DEFAULT_N;
+
+  // Time the plain recursive version first, for comparison
+  size_t start = time_ns();
+  long expected = fib(n);
+  size_t serial_ns = time_ns() - start;
+
+  // Fork one task per subproblem, then join them all and add up their results
+  scheduler_init();
+  start = time_ns();
+  split(n, SPLIT_DEPTH);
+  task_future_t* futures = malloc(sizeof(task_future_t) * num_jobs);
+  if (futures == NULL) {
+    perror("malloc failed");
+    exit(2);
+  }
+  for (int i = 0; i < num_jobs; i++) {
+    task_create_arg(&futures[i], fib_task, (void*)(intptr_t)jobs[i]);
+  }
+  task_await_all(futures, num_jobs);
+
+  long sum = 0;
+  for (int i = 0; i < num_jobs; i++) {
+    sum += (intptr_t)futures[i].result;
+  }
+  size_t parallel_ns = time_ns() - start;
+
+  printf("fib(%d) = %ld%s\n", n, sum, sum == expected ? "" : " (WRONG)");
+  printf("Serial:   %8.2fms\n", serial_ns / 1e6);
+  printf("%d tasks: %8.2fms (%.2fx)\n", num_jobs, parallel_ns / 1e6,
+         (double)serial_ns / parallel_ns);
+
+  free(futures);
+  return sum == expected ? 0 : 1;
+}
@@ -0,0 +1,115 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "context.h"
+#include "scheduler.h"
+
+// The number of round trips to make unless a different count is given on the command line
+#define DEFAULT_ROUNDS 1000000
+
+// The size of the stack for the raw context switch test
+#define BOUNCE_STACK_SIZE 65536
+
+size_t rounds;
+
+context_t main_context;
+context_t bounce_context;
+
+task_channel_t channel;
+
+// Get the time in nanoseconds from a clock that never jumps
+size_t time_ns() {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+    perror("clock_gettime");
+    exit(2);
+  }
+  return ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Switch straight back to main every time main switches here
+void bounce() {
+  while (true) {
+    context_switch(&bounce_context, &main_context);
+  }
+}
+
+// Yield to the other ping-pong task, which yields straight back
+void yield_fn() {
+  for (size_t i = 0; i < rounds; i++) {
+    task_yield();
+  }
+}
+
+// Send numbers to the receiving task one at a time
+void send_fn() {
+  for (size_t i = 0; i < rounds; i++) {
+    task_channel_send(&channel, (void*)(uintptr_t)i);
+  }
+  task_channel_close(&channel);
+}
+
+// Receive numbers until the sending task closes the channel
+void receive_fn() {
+  void* item;
+  while (task_channel_receive(&channel, &item)) {
+  }
+}
+
+// Print a result line for a number of switches made in some time
+void report(const char* name, size_t switches, size_t ns) {
+  printf("%-22s %10lu switches in %8.3fms: %7.1fns per switch, %6.2fM switches/s\n", name,
+         switches, ns / 1e6, (double)ns / switches, switches * 1e3 / ns);
+}
+
+int main(int argc, char** argv) {
+  if (argc > 2) {
+    fprintf(stderr, "Usage: %s [round trips]\n", argv[0]);
+    exit(1);
+  }
+  rounds = argc == 2 ? atol(argv[1]) : DEFAULT_ROUNDS;
+
+  printf("Context switches use %s\n", context_engine());
+
+  // Bounce between two bare contexts, with no scheduler involved
+  void* stack = malloc(BOUNCE_STACK_SIZE);
+  if (stack == NULL) {
+    perror("malloc failed");
+    exit(2);
+  }
+  context_init(&bounce_context, stack, BOUNCE_STACK_SIZE, bounce);
+  size_t start = time_ns();
+  for (size_t i = 0; i < rounds; i++) {
+    context_switch(&main_context, &bounce_context);
+  }
+  report("context_switch", 2 * rounds, time_ns() - start);
+
+  // Pass the CPU back and forth between two tasks through the scheduler
+  scheduler_init();
+  task_t ping;
+  task_t pong;
+  start = time_ns();
+  task_create(&ping, yield_fn);
+  task_create(&pong, yield_fn);
+  task_wait(ping);
+  task_wait(pong);
+  report("task_yield", 2 * rounds, time_ns() - start);
+
+  // Pass messages through a channel with room for one, so every message is a switch each way
+  task_channel_init(&channel, 1);
+  task_t sender;
+  task_t receiver;
+  start = time_ns();
+  task_create(&sender, send_fn);
+  task_create(&receiver, receive_fn);
+  task_wait(sender);
+  task_wait(receiver);
+  report("task_channel_send", 2 * rounds, time_ns() - start);
+  task_channel_destroy(&channel);
+
+  free(stack);
+  return 0;
+}
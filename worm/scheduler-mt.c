@@ -0,0 +1,1230 @@
+#define _GNU_SOURCE
+
+#include <curses.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "context.h"
+#include "scheduler.h"
+#include "stack.h"
+#include "util.h"
+
+// Task slots are allocated in chunks of this many. Chunks never move, so a task can be looked
+// up from any thread while another thread adds slots.
+#define TASK_CHUNK_SIZE 1024
+
+// This is an upper limit on the number of chunks, so there can be over a million live tasks
+#define MAX_TASK_CHUNKS 1024
+
+// This is an upper limit on the number of worker threads
+#define MAX_WORKERS 64
+
+// The number of tasks a work-stealing deque can hold before it has to grow
+#define INITIAL_DEQUE_SIZE 256
+
+// How long tasks sleep between checks for input or I/O readiness, in milliseconds
+#define POLL_INTERVAL 10
+
+// This struct will hold the all the necessary information for each task
+typedef struct task_info {
+  // This field stores all the state required to switch back to this task
+  context_t context;
+
+  // The stack the task runs on. Its base is NULL for the program's original thread.
+  task_stack_t stack;
+
+  // The function this task runs. Tasks made by task_create_arg run arg_fn with arg instead, and
+  // put the result in future.
+  task_fn_t fn;
+  task_arg_fn_t arg_fn;
+  void* arg;
+  task_future_t* future;
+
+  // The index of this task's slot
+  int index;
+
+  // Counts the tasks that have used this slot, so handles to earlier ones can be told apart
+  unsigned generation;
+
+  // 'R': Ready or running, 'S': Sleep, 'W': Wait, 'L': wait on a Lock, condition variable, or
+  // channel, 'E': Exited
+  char state;
+
+  // store when this task should wake up if this task is of state 'S', in monotonic_ms() time
+  size_t wake_up_time;
+
+  // Protects state, generation, and waiters while other threads may be looking at them
+  pthread_mutex_t lock;
+
+  // The next task on whichever list this task is on: another task's waiters, the global queue,
+  // the queue of a mutex, condition variable, or channel, or the free slots
+  struct task_info* next;
+
+  // Tasks in state 'W' that are waiting for this task to exit
+  struct task_info* waiters;
+
+  // Time accounting, and when the task last started running, became ready, or blocked
+  task_stats_t stats;
+  size_t state_since;
+} task_info_t;
+
+/// The buffer of a work-stealing deque. Old buffers are kept when a deque grows, because a thief
+/// may still be reading one.
+typedef struct deque_array {
+  long size;                      //< The number of entries, always a power of two
+  struct deque_array* previous;   //< The buffer this one replaced
+  _Atomic(task_info_t*) tasks[];  //< Entry i holds the task at position i modulo size
+} deque_array_t;
+
+/// A Chase-Lev work-stealing deque. Only its worker pushes and takes, at the bottom. Any worker
+/// can steal from the top.
+typedef struct deque {
+  atomic_long top;
+  atomic_long bottom;
+  _Atomic(deque_array_t*) array;
+} deque_t;
+
+/// A function a worker runs for a task once the task's context is saved, on the worker's own
+/// stack. It lets a task publish itself to other threads only when it is safe to resume.
+typedef void (*post_fn_t)(task_info_t* task, void* arg);
+
+/// The state of one worker thread
+typedef struct worker {
+  context_t context;  //< The worker's scheduling loop, which tasks switch to when they stop
+  deque_t deque;      //< Ready tasks this worker made runnable
+  task_info_t* current;  //< The task this worker is running
+  post_fn_t post;        //< The action to run once current has switched back to the worker
+  void* post_arg;        //< The argument for the post action
+  unsigned seed;         //< Used to pick which worker to steal from
+  pthread_t thread;
+} worker_t;
+
+/// Returned by deque_steal when it lost a race with another thread and should be tried again
+#define STEAL_RETRY ((task_info_t*)1)
+
+worker_t workers[MAX_WORKERS];  //< Every worker. Worker 0 runs on the program's original thread.
+size_t num_workers = 0;         //< The number of workers, or 0 to use one per CPU
+
+/// The worker running on this thread. Read it through current_worker(), since a task can move to
+/// a different thread every time it switches.
+__thread worker_t* this_worker = NULL;
+
+task_info_t** task_chunks[MAX_TASK_CHUNKS];  //< The task table, in chunks of TASK_CHUNK_SIZE
+int num_tasks = 0;                           //< The number of task slots used so far
+task_info_t* free_slots = NULL;              //< Slots of exited tasks, ready to be reused
+pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;  //< Protects the fields above
+
+/// Stacks come from the stack pool, which is not thread safe on its own
+pthread_mutex_t stack_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Tasks that yielded, in the order they yielded. Workers run these when their deques are empty,
+/// so a yielding task lets the others go first.
+task_info_t* yielded_head = NULL;
+task_info_t* yielded_tail = NULL;
+pthread_mutex_t yielded_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Sleeping tasks, kept as a min-heap on wake_up_time so the next one to wake is sleepers[0]
+task_info_t** sleepers = NULL;
+int num_sleepers = 0;  //< The number of tasks in the sleepers heap
+int max_sleepers = 0;  //< The number of tasks the sleepers heap has room for
+pthread_mutex_t sleepers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Idle workers wait on idle_cond. Anything that makes a task ready bumps work_epoch first, so a
+/// worker that saw the same epoch before and after looking for work knows it missed nothing.
+atomic_long work_epoch = 0;
+atomic_int num_idle = 0;
+pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t idle_cond;
+
+/// Only one task reads input at a time, since ncurses is not thread safe
+pthread_mutex_t input_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Set by scheduler_set_accounting
+atomic_bool accounting = false;
+
+input_fn_t read_key = NULL;      //< Set by scheduler_set_input, or NULL to use getch
+atomic_size_t num_switches = 0;  //< The number of times a task has been switched in
+
+/// Protects every mutex, condition variable, and channel. Tasks only hold it for a few
+/// instructions, so one lock is simpler than one per object and rarely contended.
+pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Get the worker running on this thread. This is a real call every time, so the compiler can't
+ * reuse a value it read before a context switch moved the task to another thread.
+ */
+__attribute__((noinline)) worker_t* current_worker() {
+  return this_worker;
+}
+
+/**
+ * Get the task running on this thread.
+ */
+task_info_t* current_task() {
+  return current_worker()->current;
+}
+
+/**
+ * Look up a task slot by index.
+ *
+ * \param index  The index of a slot that has been allocated
+ * \returns the task in that slot
+ */
+task_info_t* task_lookup(int index) {
+  return task_chunks[index / TASK_CHUNK_SIZE][index % TASK_CHUNK_SIZE];
+}
+
+/**
+ * Set up a deque with room for INITIAL_DEQUE_SIZE tasks.
+ *
+ * \param deque  The deque to set up
+ */
+void deque_init(deque_t* deque) {
+  deque_array_t* array =
+      calloc(1, sizeof(deque_array_t) + sizeof(task_info_t*) * INITIAL_DEQUE_SIZE);
+  if (array == NULL) {
+    perror("calloc failed");
+    exit(2);
+  }
+  array->size = INITIAL_DEQUE_SIZE;
+  atomic_init(&deque->top, 0);
+  atomic_init(&deque->bottom, 0);
+  atomic_init(&deque->array, array);
+}
+
+/**
+ * Push a task onto the bottom of a deque. Only the deque's own worker may call this.
+ *
+ * \param deque  The deque to push onto
+ * \param task   The task to push
+ */
+void deque_push(deque_t* deque, task_info_t* task) {
+  long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+  long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+  deque_array_t* array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+
+  // Copy everything into a buffer twice the size if this one is full
+  if (bottom - top > array->size - 1) {
+    deque_array_t* bigger =
+        malloc(sizeof(deque_array_t) + sizeof(task_info_t*) * array->size * 2);
+    if (bigger == NULL) {
+      perror("malloc failed");
+      exit(2);
+    }
+    bigger->size = array->size * 2;
+    bigger->previous = array;
+    for (long i = top; i < bottom; i++) {
+      task_info_t* t = atomic_load_explicit(&array->tasks[i % array->size], memory_order_relaxed);
+      atomic_store_explicit(&bigger->tasks[i % bigger->size], t, memory_order_relaxed);
+    }
+    atomic_store_explicit(&deque->array, bigger, memory_order_release);
+    array = bigger;
+  }
+
+  atomic_store_explicit(&array->tasks[bottom % array->size], task, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+}
+
+/**
+ * Take the task at the bottom of a deque. Only the deque's own worker may call this.
+ *
+ * \param deque  The deque to take from
+ * \returns the task, or NULL if the deque is empty
+ */
+task_info_t* deque_take(deque_t* deque) {
+  long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+  deque_array_t* array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+  atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  long top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+  if (top > bottom) {
+    // The deque was empty
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    return NULL;
+  }
+
+  task_info_t* task = atomic_load_explicit(&array->tasks[bottom % array->size],
+                                           memory_order_relaxed);
+  if (top == bottom) {
+    // This is the last task, so race thieves for it
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed)) {
+      task = NULL;
+    }
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+  }
+  return task;
+}
+
+/**
+ * Steal the task at the top of another worker's deque.
+ *
+ * \param deque  The deque to steal from
+ * \returns the task, NULL if the deque is empty, or STEAL_RETRY if another thread got there first
+ */
+task_info_t* deque_steal(deque_t* deque) {
+  long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  long bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+  if (top >= bottom) return NULL;
+
+  deque_array_t* array = atomic_load_explicit(&deque->array, memory_order_acquire);
+  task_info_t* task = atomic_load_explicit(&array->tasks[top % array->size],
+                                           memory_order_relaxed);
+  if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst,
+                                               memory_order_relaxed)) {
+    return STEAL_RETRY;
+  }
+  return task;
+}
+
+/**
+ * Tell idle workers that there may be new work.
+ */
+void notify_work() {
+  atomic_fetch_add(&work_epoch, 1);
+  if (atomic_load(&num_idle) > 0) {
+    pthread_mutex_lock(&idle_lock);
+    pthread_cond_signal(&idle_cond);
+    pthread_mutex_unlock(&idle_lock);
+  }
+}
+
+/**
+ * Mark a task ready and push it onto the current worker's deque.
+ *
+ * \param task  A task that is not running and not on any list
+ */
+void make_ready(task_info_t* task) {
+  if (accounting) {
+    size_t now = monotonic_ns();
+    task->stats.blocked_ns += now - task->state_since;
+    task->state_since = now;
+  }
+  task->state = 'R';
+  deque_push(&current_worker()->deque, task);
+  notify_work();
+}
+
+/**
+ * Add a sleeping task to the heap of sleepers. The caller must hold sleepers_lock.
+ *
+ * \param task  A task whose wake_up_time is set
+ */
+void sleepers_push(task_info_t* task) {
+  if (num_sleepers == max_sleepers) {
+    max_sleepers = max_sleepers == 0 ? TASK_CHUNK_SIZE : max_sleepers * 2;
+    sleepers = realloc(sleepers, sizeof(task_info_t*) * max_sleepers);
+    if (sleepers == NULL) {
+      perror("realloc failed");
+      exit(2);
+    }
+  }
+
+  // Move the new task up until its parent wakes no later than it does
+  int i = num_sleepers++;
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (sleepers[parent]->wake_up_time <= task->wake_up_time) break;
+    sleepers[i] = sleepers[parent];
+    i = parent;
+  }
+  sleepers[i] = task;
+}
+
+/**
+ * Remove the task that wakes first from the heap of sleepers. The caller must hold
+ * sleepers_lock.
+ *
+ * \returns the removed task
+ */
+task_info_t* sleepers_pop() {
+  task_info_t* first = sleepers[0];
+  task_info_t* last = sleepers[--num_sleepers];
+
+  // Move the last task down from the root until both children wake no earlier than it does
+  int i = 0;
+  while (2 * i + 1 < num_sleepers) {
+    int child = 2 * i + 1;
+    if (child + 1 < num_sleepers &&
+        sleepers[child + 1]->wake_up_time < sleepers[child]->wake_up_time) {
+      child++;
+    }
+    if (last->wake_up_time <= sleepers[child]->wake_up_time) break;
+    sleepers[i] = sleepers[child];
+    i = child;
+  }
+  sleepers[i] = last;
+  return first;
+}
+
+/**
+ * Make every sleeping task whose time has come ready on the current worker.
+ *
+ * \returns the time the next sleeper is due to wake, or SIZE_MAX if nothing is asleep
+ */
+size_t wake_sleepers() {
+  pthread_mutex_lock(&sleepers_lock);
+  size_t now = monotonic_ms();
+  while (num_sleepers > 0 && sleepers[0]->wake_up_time <= now) {
+    make_ready(sleepers_pop());
+  }
+  size_t next = num_sleepers > 0 ? sleepers[0]->wake_up_time : SIZE_MAX;
+  pthread_mutex_unlock(&sleepers_lock);
+  return next;
+}
+
+/**
+ * Remove the task that yielded first from the queue of yielded tasks.
+ *
+ * \returns the task, or NULL if no task is waiting there
+ */
+task_info_t* yielded_pop() {
+  pthread_mutex_lock(&yielded_lock);
+  task_info_t* task = yielded_head;
+  if (task != NULL) {
+    yielded_head = task->next;
+    if (yielded_head == NULL) yielded_tail = NULL;
+  }
+  pthread_mutex_unlock(&yielded_lock);
+  return task;
+}
+
+/**
+ * Block a worker until there may be work for it or the next sleeper is due.
+ *
+ * \param epoch     The value of work_epoch from before the worker last looked for work
+ * \param deadline  The time the next sleeper is due, or SIZE_MAX if nothing is asleep
+ */
+void worker_idle(long epoch, size_t deadline) {
+  pthread_mutex_lock(&idle_lock);
+  atomic_fetch_add(&num_idle, 1);
+  if (atomic_load(&work_epoch) == epoch) {
+    if (deadline == SIZE_MAX) {
+      pthread_cond_wait(&idle_cond, &idle_lock);
+    } else {
+      struct timespec ts;
+      ts.tv_sec = deadline / 1000;
+      ts.tv_nsec = (deadline % 1000) * 1000000;
+      pthread_cond_timedwait(&idle_cond, &idle_lock, &ts);
+    }
+  }
+  atomic_fetch_sub(&num_idle, 1);
+  pthread_mutex_unlock(&idle_lock);
+}
+
+/**
+ * Find a task for a worker to run, waiting if there is none. Workers look at their own deque
+ * first, then at tasks that yielded, then at other workers' deques.
+ *
+ * \param w  The worker looking for a task
+ * \returns the task to run
+ */
+task_info_t* find_task(worker_t* w) {
+  while (true) {
+    long epoch = atomic_load(&work_epoch);
+    size_t deadline = wake_sleepers();
+
+    task_info_t* task = deque_take(&w->deque);
+    if (task != NULL) return task;
+
+    task = yielded_pop();
+    if (task != NULL) return task;
+
+    // Try every other worker, starting from a random one. Try again if a steal lost a race.
+    bool retry = true;
+    while (retry) {
+      retry = false;
+      size_t start = rand_r(&w->seed) % num_workers;
+      for (size_t i = 0; i < num_workers; i++) {
+        worker_t* victim = &workers[(start + i) % num_workers];
+        if (victim == w) continue;
+        task = deque_steal(&victim->deque);
+        if (task == STEAL_RETRY) {
+          retry = true;
+        } else if (task != NULL) {
+          return task;
+        }
+      }
+    }
+
+    worker_idle(epoch, deadline);
+  }
+}
+
+/**
+ * Run tasks on a worker forever. This runs on the worker's own stack, and tasks switch back to
+ * it whenever they stop running.
+ *
+ * \param w  The worker
+ */
+void worker_loop(worker_t* w) {
+  while (true) {
+    // Finish whatever the last task asked for now that its context is saved
+    if (w->post != NULL) {
+      post_fn_t post = w->post;
+      w->post = NULL;
+      post(w->current, w->post_arg);
+    }
+
+    task_info_t* task = find_task(w);
+    w->current = task;
+    atomic_fetch_add_explicit(&num_switches, 1, memory_order_relaxed);
+    if (accounting) {
+      size_t now = monotonic_ns();
+      size_t latency = now - task->state_since;
+      task->stats.ready_ns += latency;
+      if (latency > task->stats.max_latency_ns) task->stats.max_latency_ns = latency;
+      task->stats.switches++;
+      task->state_since = now;
+    }
+    context_switch(&w->context, &task->context);
+
+    // Nothing else can touch the task until its post action hands it over
+    if (accounting) {
+      size_t now = monotonic_ns();
+      task->stats.run_ns += now - task->state_since;
+      task->state_since = now;
+    }
+  }
+}
+
+/**
+ * The start of the scheduling loop for worker 0, which gets its own stack since the program's
+ * original thread starts out running the first task.
+ */
+void worker_start() {
+  worker_loop(current_worker());
+}
+
+/**
+ * The start of every worker thread other than the first.
+ *
+ * \param arg  The worker_t for this thread
+ */
+void* worker_thread(void* arg) {
+  this_worker = arg;
+  worker_loop(arg);
+  return NULL;
+}
+
+/**
+ * Stop the running task and switch to its worker's scheduling loop. The worker calls post with
+ * the task once the task's context is saved, so post can hand the task to other threads.
+ *
+ * \param post  The action to run after the switch, or NULL
+ * \param arg   The argument for post
+ */
+void task_suspend(post_fn_t post, void* arg) {
+  worker_t* w = current_worker();
+  w->post = post;
+  w->post_arg = arg;
+  context_switch(&w->current->context, &w->context);
+}
+
+/// Post action for task_wait: let task_exit see the waiter now that it can be resumed
+void post_unlock(task_info_t* task, void* arg) {
+  pthread_mutex_unlock(arg);
+}
+
+/// Post action for task_yield: queue the task behind everything else
+void post_yield(task_info_t* task, void* arg) {
+  pthread_mutex_lock(&yielded_lock);
+  task->next = NULL;
+  if (yielded_tail == NULL) {
+    yielded_head = task;
+  } else {
+    yielded_tail->next = task;
+  }
+  yielded_tail = task;
+  pthread_mutex_unlock(&yielded_lock);
+  notify_work();
+}
+
+/// Post action for task_sleep: add the task to the sleepers
+void post_sleep(task_info_t* task, void* arg) {
+  pthread_mutex_lock(&sleepers_lock);
+  sleepers_push(task);
+  pthread_mutex_unlock(&sleepers_lock);
+
+  // An idle worker may need to wake up sooner for this sleeper
+  notify_work();
+}
+
+/// Post action for task_exit: measure and free the stack the task was running on, and free its
+/// slot
+void post_exit(task_info_t* task, void* arg) {
+  pthread_mutex_lock(&task->lock);
+  task->stats.stack_used = stack_used(&task->stack);
+  pthread_mutex_unlock(&task->lock);
+
+  pthread_mutex_lock(&stack_lock);
+  stack_free(&task->stack);
+  pthread_mutex_unlock(&stack_lock);
+  task->stack.base = NULL;
+
+  pthread_mutex_lock(&table_lock);
+  task->next = free_slots;
+  free_slots = task;
+  pthread_mutex_unlock(&table_lock);
+}
+
+/**
+ * Claim a task slot, reusing the slot of an exited task if there is one. The slot's generation
+ * changes so handles to the exited task don't refer to the new one.
+ *
+ * \returns the slot
+ */
+task_info_t* task_slot_alloc() {
+  pthread_mutex_lock(&table_lock);
+  task_info_t* task = free_slots;
+  if (task != NULL) {
+    free_slots = task->next;
+    pthread_mutex_unlock(&table_lock);
+    pthread_mutex_lock(&task->lock);
+    task->generation++;
+    pthread_mutex_unlock(&task->lock);
+    return task;
+  }
+
+  int index = num_tasks;
+  if (index / TASK_CHUNK_SIZE >= MAX_TASK_CHUNKS) {
+    fprintf(stderr, "Too many tasks.\n");
+    exit(2);
+  }
+  if (index % TASK_CHUNK_SIZE == 0) {
+    task_chunks[index / TASK_CHUNK_SIZE] = malloc(sizeof(task_info_t*) * TASK_CHUNK_SIZE);
+    if (task_chunks[index / TASK_CHUNK_SIZE] == NULL) {
+      perror("malloc failed");
+      exit(2);
+    }
+  }
+  task = calloc(1, sizeof(task_info_t));
+  if (task == NULL) {
+    perror("calloc failed");
+    exit(2);
+  }
+  task->index = index;
+  pthread_mutex_init(&task->lock, NULL);
+  task_chunks[index / TASK_CHUNK_SIZE][index % TASK_CHUNK_SIZE] = task;
+  num_tasks++;
+  pthread_mutex_unlock(&table_lock);
+  return task;
+}
+
+/**
+ * Set the number of worker threads. Call this before scheduler_init.
+ *
+ * \param n  The number of worker threads
+ */
+void scheduler_set_workers(size_t n) {
+  num_workers = n;
+}
+
+/**
+ * Initialize the scheduler. Programs should call this before calling any other
+ * functiosn in this file.
+ */
+void scheduler_init() {
+  if (num_workers == 0) num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_workers < 1) num_workers = 1;
+  if (num_workers > MAX_WORKERS) num_workers = MAX_WORKERS;
+
+  // Idle workers wait for the next sleeper on the same clock monotonic_ms() uses
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&idle_cond, &attr);
+  pthread_condattr_destroy(&attr);
+
+  // The program's original thread becomes worker 0, running the first task
+  for (size_t i = 0; i < num_workers; i++) {
+    deque_init(&workers[i].deque);
+    workers[i].seed = i + 1;
+  }
+  this_worker = &workers[0];
+  workers[0].current = task_slot_alloc();
+  workers[0].current->state = 'R';
+  task_stack_t stack;
+  stack_alloc(&stack, STACK_SIZE, 0);
+  context_init(&workers[0].context, stack.low, STACK_SIZE, worker_start);
+
+  for (size_t i = 1; i < num_workers; i++) {
+    if (pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]) != 0) {
+      perror("pthread_create failed");
+      exit(2);
+    }
+  }
+}
+
+/**
+ * This function will execute when a task's function returns. Wake every task waiting for this
+ * one, then switch away for good.
+ */
+void task_exit() {
+  task_info_t* self = current_task();
+
+  // Set the state to 'E' and take the waiters while nobody else can add to them
+  pthread_mutex_lock(&self->lock);
+  self->state = 'E';
+  task_info_t* waiters = self->waiters;
+  self->waiters = NULL;
+  pthread_mutex_unlock(&self->lock);
+
+  while (waiters != NULL) {
+    task_info_t* next = waiters->next;
+    make_ready(waiters);
+    waiters = next;
+  }
+
+  // The worker frees this task's stack and slot once it is no longer running on them
+  task_suspend(post_exit, NULL);
+}
+
+/**
+ * Every task starts here, on its own stack.
+ */
+void task_start() {
+  task_info_t* self = current_task();
+  if (self->future != NULL) {
+    self->future->result = self->arg_fn(self->arg);
+    self->future->done = true;
+  } else {
+    self->fn();
+  }
+  task_exit();
+}
+
+/**
+ * Set up a new task with a stack, but don't make it ready yet. Workers have no fault handler to
+ * grow stacks with, so a task that asks for a growable stack gets the largest size it could grow
+ * to. Those pages are only committed as the task touches them anyway.
+ *
+ * \param handle  The handle for this task will be written to this location.
+ * \param attr    The task's stack size settings, or NULL for a STACK_SIZE stack
+ * \returns the new task
+ */
+task_info_t* task_prepare(task_t* handle, const task_attr_t* attr) {
+  task_info_t* task = task_slot_alloc();
+  handle->index = task->index;
+  handle->generation = task->generation;
+
+  size_t size = attr == NULL || attr->stack_size == 0 ? STACK_SIZE : attr->stack_size;
+  if (attr != NULL && attr->stack_max > size) size = attr->stack_max;
+  pthread_mutex_lock(&stack_lock);
+  stack_alloc(&task->stack, size, 0);
+  pthread_mutex_unlock(&stack_lock);
+  if (accounting) stack_paint(&task->stack);
+
+  task->waiters = NULL;
+  task->future = NULL;
+  memset(&task->stats, 0, sizeof(task_stats_t));
+  task->stats.stack_size = task->stack.top - task->stack.low;
+  task->state_since = accounting ? monotonic_ns() : 0;
+  context_init(&task->context, task->stack.low, task->stats.stack_size, task_start);
+  return task;
+}
+
+/**
+ * Create a new task and add it to the scheduler.
+ *
+ * \param handle  The handle for this task will be written to this location.
+ * \param fn      The new task will run this function.
+ */
+void task_create(task_t* handle, task_fn_t fn) {
+  task_create_ex(handle, fn, NULL);
+}
+
+/**
+ * Create a new task that runs a function with an argument, and keep its result in a future.
+ *
+ * \param future  The future for the task's result. The task's handle is written to future->task.
+ * \param fn      The new task will run this function.
+ * \param arg     The argument to pass to fn
+ */
+void task_create_arg(task_future_t* future, task_arg_fn_t fn, void* arg) {
+  task_info_t* task = task_prepare(&future->task, NULL);
+  task->arg_fn = fn;
+  task->arg = arg;
+  task->future = future;
+  future->result = NULL;
+  future->done = false;
+  make_ready(task);
+}
+
+/**
+ * Wait for the task behind a future to finish and get its result.
+ *
+ * \param future  A future set up by task_create_arg
+ * \returns what the task's function returned
+ */
+void* task_join(task_future_t* future) {
+  task_wait(future->task);
+  return future->result;
+}
+
+/**
+ * Wait for the tasks behind several futures to finish. Waiting on each in turn is enough, since
+ * a task that already finished doesn't block.
+ *
+ * \param futures  An array of futures set up by task_create_arg
+ * \param count    The number of futures in the array
+ */
+void task_await_all(task_future_t* futures, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    task_wait(futures[i].task);
+  }
+}
+
+
+/**
+ * Create a new task and add it to the scheduler. Workers run tasks in the order their deques
+ * give them, so this scheduler ignores priorities and deadlines.
+ *
+ * \param handle  The handle for this task will be written to this location.
+ * \param fn      The new task will run this function.
+ * \param attr    The task's stack size settings, or NULL for a STACK_SIZE stack
+ */
+void task_create_ex(task_t* handle, task_fn_t fn, const task_attr_t* attr) {
+  task_info_t* task = task_prepare(handle, attr);
+  task->fn = fn;
+  make_ready(task);
+}
+
+/**
+ * Wait for a task to finish. If the task has not yet finished, suspend this task until
+ * task_exit wakes it up.
+ *
+ * \param handle  This is the handle produced by task_create
+ */
+void task_wait(task_t handle) {
+  task_info_t* task = task_lookup(handle.index);
+  task_info_t* self = current_task();
+
+  pthread_mutex_lock(&task->lock);
+  if (task->generation != handle.generation || task->state == 'E') {
+    pthread_mutex_unlock(&task->lock);
+    return;
+  }
+
+  // Join the waiters, but keep the lock until this task's context is saved. Otherwise the task
+  // could exit and resume this one on another worker before it has stopped running here.
+  self->state = 'W';
+  self->next = task->waiters;
+  task->waiters = self;
+  task_suspend(post_unlock, &task->lock);
+}
+
+/**
+ * The currently-executing task should sleep for a specified time.
+ *
+ * \param ms  The number of milliseconds the task should sleep.
+ */
+void task_sleep(size_t ms) {
+  task_info_t* self = current_task();
+  self->wake_up_time = monotonic_ms() + ms;
+  self->state = 'S';
+  task_suspend(post_sleep, NULL);
+}
+
+/**
+ * Give up the CPU to the other ready tasks.
+ */
+void task_yield() {
+  task_suspend(post_yield, NULL);
+}
+
+/**
+ * Read a character from user input, blocking this task until one is available. ncurses can't be
+ * used from two threads at once, so this checks for input under a lock and sleeps in between.
+ *
+ * \returns The read character code
+ */
+int task_readchar() {
+  while (true) {
+    pthread_mutex_lock(&input_lock);
+    int ch = read_key == NULL ? getch() : read_key();
+    pthread_mutex_unlock(&input_lock);
+    if (ch != ERR) return ch;
+    task_sleep(POLL_INTERVAL);
+  }
+}
+
+/**
+ * Block the current task until a file descriptor is ready for I/O. This scheduler has no
+ * reactor, so it checks the descriptor with poll and sleeps in between.
+ *
+ * \param fd      The file descriptor to wait on
+ * \param events  The poll events to wait for, such as POLLIN or POLLOUT
+ * \returns the poll events that are ready, which may include POLLERR or POLLHUP
+ */
+int task_wait_fd(int fd, int events) {
+  while (true) {
+    struct pollfd pfd = {.fd = fd, .events = events};
+    if (poll(&pfd, 1, 0) == -1 && errno != EINTR) {
+      perror("poll failed");
+      exit(2);
+    }
+    if (pfd.revents != 0) return pfd.revents;
+    task_sleep(POLL_INTERVAL);
+  }
+}
+
+/**
+ * Stop waiting on a file descriptor. Waiters here poll the descriptor rather than register it,
+ * so nothing is left behind, and once the descriptor is closed their next poll reports
+ * POLLNVAL. This does nothing.
+ *
+ * \param fd  The file descriptor
+ */
+void task_cancel_fd(int fd) {}
+
+/**
+ * Preemption is not supported by the multi-threaded scheduler, so this does nothing. A
+ * CPU-bound task only holds up its own worker.
+ */
+void scheduler_set_quantum(size_t ms) {}
+
+/**
+ * Preemption is not supported by the multi-threaded scheduler, so this does nothing.
+ */
+void task_preempt_disable() {}
+
+/**
+ * Preemption is not supported by the multi-threaded scheduler, so this does nothing.
+ */
+void task_preempt_enable() {}
+
+/**
+ * Block the current task on the queue of a mutex, condition variable, or channel until another
+ * task wakes it with queue_wake. The caller must hold sync_lock, which is released once the
+ * task's context is saved.
+ *
+ * \param queue  The queue to wait on
+ */
+void queue_block(task_queue_t* queue) {
+  task_info_t* self = current_task();
+  self->state = 'L';
+  self->next = NULL;
+  if (queue->tail == -1) {
+    queue->head = self->index;
+  } else {
+    task_lookup(queue->tail)->next = self;
+  }
+  queue->tail = self->index;
+  task_suspend(post_unlock, &sync_lock);
+}
+
+/**
+ * Wake the task that has been blocked longest on a queue. The caller must hold sync_lock.
+ *
+ * \param queue  The queue to wake a task from
+ * \returns true if a task was woken, or false if the queue was empty
+ */
+bool queue_wake(task_queue_t* queue) {
+  if (queue->head == -1) return false;
+  task_info_t* task = task_lookup(queue->head);
+  queue->head = task->next == NULL ? -1 : task->next->index;
+  if (queue->head == -1) queue->tail = -1;
+  make_ready(task);
+  return true;
+}
+
+/**
+ * Set up a mutex, which starts unlocked.
+ *
+ * \param mutex  The mutex to set up
+ */
+void task_mutex_init(task_mutex_t* mutex) {
+  mutex->locked = false;
+  mutex->waiters.head = -1;
+  mutex->waiters.tail = -1;
+}
+
+/**
+ * Lock a mutex, blocking this task until it is this task's turn if another task holds it.
+ *
+ * \param mutex  The mutex to lock
+ */
+void task_mutex_lock(task_mutex_t* mutex) {
+  pthread_mutex_lock(&sync_lock);
+  if (mutex->locked) {
+    // task_mutex_unlock hands the mutex straight to the first waiter, so it stays locked
+    queue_block(&mutex->waiters);
+  } else {
+    mutex->locked = true;
+    pthread_mutex_unlock(&sync_lock);
+  }
+}
+
+/**
+ * Unlock a mutex, handing it to the next waiting task if there is one.
+ *
+ * \param mutex  The mutex to unlock
+ */
+void task_mutex_unlock(task_mutex_t* mutex) {
+  pthread_mutex_lock(&sync_lock);
+  if (!queue_wake(&mutex->waiters)) mutex->locked = false;
+  pthread_mutex_unlock(&sync_lock);
+}
+
+/**
+ * Set up a condition variable with no waiters.
+ *
+ * \param cond  The condition variable to set up
+ */
+void task_cond_init(task_cond_t* cond) {
+  cond->waiters.head = -1;
+  cond->waiters.tail = -1;
+}
+
+/**
+ * Unlock a mutex and block until the condition variable is signaled, then lock the mutex again.
+ *
+ * \param cond   The condition variable to wait on
+ * \param mutex  A mutex the current task holds
+ */
+void task_cond_wait(task_cond_t* cond, task_mutex_t* mutex) {
+  // Release the mutex and join the waiters under one lock, so no signal can slip in between
+  pthread_mutex_lock(&sync_lock);
+  if (!queue_wake(&mutex->waiters)) mutex->locked = false;
+  queue_block(&cond->waiters);
+  task_mutex_lock(mutex);
+}
+
+/**
+ * Wake the task that has waited longest on a condition variable, if any task is waiting.
+ *
+ * \param cond  The condition variable to signal
+ */
+void task_cond_signal(task_cond_t* cond) {
+  pthread_mutex_lock(&sync_lock);
+  queue_wake(&cond->waiters);
+  pthread_mutex_unlock(&sync_lock);
+}
+
+/**
+ * Wake every task waiting on a condition variable.
+ *
+ * \param cond  The condition variable to signal
+ */
+void task_cond_broadcast(task_cond_t* cond) {
+  pthread_mutex_lock(&sync_lock);
+  while (queue_wake(&cond->waiters)) {
+  }
+  pthread_mutex_unlock(&sync_lock);
+}
+
+/**
+ * Set up an empty channel.
+ *
+ * \param channel   The channel to set up
+ * \param capacity  The most items the channel can hold, which must be at least one
+ */
+void task_channel_init(task_channel_t* channel, size_t capacity) {
+  channel->items = malloc(sizeof(void*) * capacity);
+  if (channel->items == NULL) {
+    perror("malloc failed");
+    exit(2);
+  }
+  channel->capacity = capacity;
+  channel->head = 0;
+  channel->count = 0;
+  channel->closed = false;
+  channel->senders.head = -1;
+  channel->senders.tail = -1;
+  channel->receivers.head = -1;
+  channel->receivers.tail = -1;
+}
+
+/**
+ * Free the memory a channel uses.
+ *
+ * \param channel  The channel to free
+ */
+void task_channel_destroy(task_channel_t* channel) {
+  free(channel->items);
+  channel->items = NULL;
+}
+
+/**
+ * Add an item to a channel, blocking while the channel is full.
+ *
+ * \param channel  The channel to send to
+ * \param item     The item to send
+ * \returns false if the channel was closed and the item was not sent, otherwise true
+ */
+bool task_channel_send(task_channel_t* channel, void* item) {
+  pthread_mutex_lock(&sync_lock);
+
+  // A woken sender may find the channel full again if another task got there first
+  while (channel->count == channel->capacity && !channel->closed) {
+    queue_block(&channel->senders);
+    pthread_mutex_lock(&sync_lock);
+  }
+  if (channel->closed) {
+    pthread_mutex_unlock(&sync_lock);
+    return false;
+  }
+
+  channel->items[(channel->head + channel->count) % channel->capacity] = item;
+  channel->count++;
+  queue_wake(&channel->receivers);
+  pthread_mutex_unlock(&sync_lock);
+  return true;
+}
+
+/**
+ * Take the oldest item from a channel, blocking while the channel is empty.
+ *
+ * \param channel  The channel to receive from
+ * \param item     The item is written to this location
+ * \returns false once the channel is closed and every item has been received, otherwise true
+ */
+bool task_channel_receive(task_channel_t* channel, void** item) {
+  pthread_mutex_lock(&sync_lock);
+  while (channel->count == 0 && !channel->closed) {
+    queue_block(&channel->receivers);
+    pthread_mutex_lock(&sync_lock);
+  }
+  if (channel->count == 0) {
+    pthread_mutex_unlock(&sync_lock);
+    return false;
+  }
+
+  *item = channel->items[channel->head];
+  channel->head = (channel->head + 1) % channel->capacity;
+  channel->count--;
+  queue_wake(&channel->senders);
+  pthread_mutex_unlock(&sync_lock);
+  return true;
+}
+
+/**
+ * Close a channel and wake every task blocked on it.
+ *
+ * \param channel  The channel to close
+ */
+void task_channel_close(task_channel_t* channel) {
+  pthread_mutex_lock(&sync_lock);
+  channel->closed = true;
+  while (queue_wake(&channel->senders)) {
+  }
+  while (queue_wake(&channel->receivers)) {
+  }
+  pthread_mutex_unlock(&sync_lock);
+}
+
+/**
+ * Turn per-task time accounting on or off. Tasks that are running or blocked when accounting is
+ * turned on count from the next time they change state.
+ *
+ * \param on  True to keep task_stats up to date
+ */
+void scheduler_set_accounting(bool on) {
+  if (on && !accounting) {
+    size_t now = monotonic_ns();
+    pthread_mutex_lock(&table_lock);
+    for (int i = 0; i < num_tasks; i++) {
+      task_lookup(i)->state_since = now;
+    }
+    pthread_mutex_unlock(&table_lock);
+  }
+  accounting = on;
+}
+
+/**
+ * Get the time accounting for a task. The counts of a task running on another worker may be a
+ * switch behind, and stack use is only measured once a task exits.
+ *
+ * \param handle  The handle produced by task_create
+ * \param stats   The counts are written to this location
+ * \returns false if the handle refers to a task whose slot has been reused, otherwise true
+ */
+bool task_stats(task_t handle, task_stats_t* stats) {
+  if (handle.index >= num_tasks) return false;
+  task_info_t* task = task_lookup(handle.index);
+  pthread_mutex_lock(&task->lock);
+  bool current = task->generation == handle.generation;
+  if (current) *stats = task->stats;
+  pthread_mutex_unlock(&task->lock);
+  return current;
+}
+
+/**
+ * This scheduler does not record scheduling events, so this only turns on accounting.
+ *
+ * \param capacity  Ignored
+ */
+void scheduler_trace_start(size_t capacity) {
+  scheduler_set_accounting(true);
+}
+
+/**
+ * This scheduler does not record scheduling events, so this does nothing.
+ */
+void scheduler_trace_stop() {}
+
+/**
+ * Write a trace with no events, since this scheduler does not record them.
+ *
+ * \param path  The file to write
+ */
+void scheduler_trace_export(const char* path) {
+  FILE* file = fopen(path, "w");
+  if (file == NULL) {
+    perror("fopen failed");
+    exit(2);
+  }
+  fprintf(file, "{\"traceEvents\":[]}\n");
+  if (fclose(file) == EOF) {
+    perror("fclose failed");
+    exit(2);
+  }
+}
+
+/**
+ * Idle workers block on a condition variable until real time passes, so this scheduler has no
+ * virtual clock and ignores this.
+ *
+ * \param on  Ignored
+ */
+void scheduler_set_virtual_clock(bool on) {}
+
+/**
+ * Get the time on the scheduler's clock, which is always the real one here.
+ *
+ * \returns monotonic_ms()
+ */
+size_t scheduler_time_ms() {
+  return monotonic_ms();
+}
+
+/**
+ * Read user input from a function instead of ncurses.
+ *
+ * \param fn  The function to read keys from, or NULL to go back to getch
+ */
+void scheduler_set_input(input_fn_t fn) {
+  read_key = fn;
+}
+
+/**
+ * Get the number of context switches the scheduler has made.
+ *
+ * \returns the number of times a task has been switched in
+ */
+size_t scheduler_switch_count() {
+  return num_switches;
+}
@@ -5,111 +5,841 @@
 
 #include <assert.h>
 #include <curses.h>
-#include <ucontext.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
 
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+#include "context.h"
+#include "stack.h"
 #include "util.h"
 
-// This is an upper limit on the number of tasks we can create.
-#define MAX_TASKS 128
+// This is the number of task slots the task table starts with. It doubles whenever it fills up.
+#define INITIAL_TASKS 64
+
+// This is the size of the stack signal handlers run on, which must work even when a task has
+// used up its own stack
+#define SIGNAL_STACK_SIZE 65536
+
+// This is the most file descriptor events handled after one wait for I/O
+#define MAX_EVENTS 64
+
+// A ready task at one priority runs after at most this many tasks at higher priorities
+#define AGING_PICKS 8
 
-// This is the size of each task's stack memory
-#define STACK_SIZE 65536
+/// A first-in, first-out list of tasks, linked through each task's next field. These are the same
+/// as the queues mutexes, condition variables, and channels keep their blocked tasks in.
+typedef task_queue_t task_list_t;
 
 // This struct will hold the all the necessary information for each task
 typedef struct task_info {
   // This field stores all the state required to switch back to this task
-  ucontext_t context;
+  context_t context;
 
-  // This field stores another context. This one is only used when the task
-  // is exiting.
-  ucontext_t exit_context;
+  // The stack the task runs on. Its base is NULL for the program's original thread.
+  task_stack_t stack;
 
-  // 'S': Sleep, 'W': Wait, 'B': Block, 'R': Ready, 'E': Exited
+  // 'S': Sleep, 'W': Wait, 'B': Block, 'F': wait for a File descriptor, 'L': wait on a Lock,
+  // condition variable, or channel, 'R': Ready, 'E': Exited
   char state;
 
-  // store when this task should wake up if this task is of state 'S'
+  // store when this task should wake up if this task is of state 'S', in scheduler_time_ms() time
   size_t wake_up_time;
 
-  // store which task is being waited if the current task if of state 'W'
-  task_t wait_task;
-
   // store the user input if the current task if of state 'B'
   int user_input;
 
+  // The poll events this task is waiting for if it is of state 'F', and then the ones that were
+  // ready when it woke up
+  int fd_events;
+  int fd_revents;
+
+  // The function this task runs. Tasks made by task_create_arg run arg_fn with arg instead, and
+  // put the result in future.
+  task_fn_t fn;
+  task_arg_fn_t arg_fn;
+  void* arg;
+  task_future_t* future;
+
+  // The preemption-disable depth this task had when it was last switched out
+  int preempt_count;
+
+  // Counts the tasks that have used this slot, so handles to earlier ones can be told apart
+  unsigned generation;
+
+  // The next task on whichever list this task is on: the ready queue, another task's waiters,
+  // the tasks blocked on input, a file descriptor, or a lock, or the free slots
+  int next;
+
+  // Tasks in state 'W' that are waiting for this task to exit
+  task_list_t waiters;
+
+  // Time accounting, and when the task last started running, became ready, or blocked
+  task_stats_t stats;
+  size_t state_since;
+
+  // The task's priority level, and its deadline settings if it is a deadline task. deadline is
+  // when the task should run by while it is ready, in scheduler_time_ms() time.
+  int priority;
+  size_t relative_deadline;
+  size_t deadline;
+
 } task_info_t;
 
-int current_task = 0;          //< The handle of the currently-executing task
-int num_tasks = 1;             //< The number of tasks created so far
-task_info_t tasks[MAX_TASKS];  //< Information for every task
+int current_task = 0;        //< The index of the currently-executing task
+int num_tasks = 0;           //< The number of task slots used so far
+int max_tasks = 0;           //< The number of task slots there is room for
+task_info_t** tasks = NULL;  //< Information for every task. Each one is allocated on its own,
+                             //< since a saved ucontext must not move.
+
+int exited_task = -1;  //< A task that exited but whose stack was still in use when it switched
+
+/// The tasks waiting on one file descriptor
+typedef struct fd_waiters {
+  task_list_t tasks;  //< Tasks in state 'F' waiting on this descriptor
+  int registered;     //< The poll events the descriptor is being watched for
+} fd_waiters_t;
+
+fd_waiters_t* fd_table = NULL;  //< Waiting tasks for every file descriptor, indexed by descriptor
+int fd_table_size = 0;          //< The number of descriptors fd_table has room for
+int num_fd_waiters = 0;         //< The number of tasks in state 'F'
+int epoll_fd = -1;              //< The epoll instance watching every descriptor tasks wait on
+
+/// One scheduling event in the trace ring buffer
+typedef struct trace_event {
+  size_t time;  //< When the event happened, in monotonic_ns() time
+  int task;     //< The task the event is about
+  int next;     //< For switches, the task switched to
+  char type;    //< 'S': Switch, 'R': made Ready, 'E': Exited
+  char state;   //< For switches, the state the task was switched out in
+} trace_event_t;
+
+bool virtual_clock = false;  //< Set by scheduler_set_virtual_clock
+size_t virtual_time = 0;     //< The time on the virtual clock, in milliseconds
+input_fn_t read_key = NULL;  //< Set by scheduler_set_input, or NULL to use getch
+size_t num_switches = 0;     //< The number of times a task has been switched in
+
+bool accounting = false;             //< Set by scheduler_set_accounting
+trace_event_t* trace_events = NULL;  //< The trace ring buffer
+size_t trace_capacity = 0;           //< The number of events the ring buffer holds
+size_t trace_count = 0;  //< The number of events recorded. Older ones have been overwritten.
+bool tracing = false;    //< True while events are being recorded
+
+/// Tasks in state 'R' waiting for their turn to run, with one queue per priority level
+task_list_t ready[TASK_PRIORITIES];
+int skipped[TASK_PRIORITIES];  //< Picks of higher-priority tasks while each level was waiting
+unsigned ready_levels = 0;     //< Bit p is set while ready[p] is not empty
+
+/// Ready deadline tasks, kept as a min-heap on deadline so the most urgent one is deadlines[0].
+/// It has room for max_tasks entries.
+int* deadlines = NULL;
+int num_deadlines = 0;  //< The number of tasks in the deadlines heap
+
+int num_ready = 0;  //< The number of ready tasks on every queue, not counting the running one
+task_list_t input = {-1, -1};       //< Tasks in state 'B', in the order they asked for input
+task_list_t free_slots = {-1, -1};  //< Slots of exited tasks, ready to be reused
+
+/**
+ * Add a task to the end of a list.
+ *
+ * \param list  The list to add to
+ * \param task  A task that is not on any list
+ */
+void list_push(task_list_t* list, int task) {
+  tasks[task]->next = -1;
+  if (list->tail == -1) {
+    list->head = task;
+  } else {
+    tasks[list->tail]->next = task;
+  }
+  list->tail = task;
+}
+
+/**
+ * Remove the task at the front of a list.
+ *
+ * \param list  A list that is not empty
+ * \returns the removed task
+ */
+int list_pop(task_list_t* list) {
+  int task = list->head;
+  list->head = tasks[task]->next;
+  if (list->head == -1) list->tail = -1;
+  return task;
+}
+
+/**
+ * Add an event to the trace ring buffer, overwriting the oldest one if it is full.
+ *
+ * \param time   When the event happened
+ * \param type   The kind of event
+ * \param task   The task the event is about
+ * \param next   For switches, the task switched to
+ * \param state  For switches, the state the task was switched out in
+ */
+void trace_record(size_t time, char type, int task, int next, char state) {
+  trace_event_t* event = &trace_events[trace_count % trace_capacity];
+  event->time = time;
+  event->type = type;
+  event->task = task;
+  event->next = next;
+  event->state = state;
+  trace_count++;
+}
+
+/**
+ * Get the time on the scheduler's clock, which task_sleep measures against.
+ *
+ * \returns the time in milliseconds, from monotonic_ms() or the virtual clock
+ */
+size_t scheduler_time_ms() {
+  return virtual_clock ? virtual_time : monotonic_ms();
+}
+
+/**
+ * Read the next key of user input without blocking.
+ *
+ * \returns the key, or ERR if there is none
+ */
+int input_read() {
+  return read_key == NULL ? getch() : read_key();
+}
+
+/**
+ * Add a ready deadline task to the heap of deadlines.
+ *
+ * \param task  A task whose deadline is set
+ */
+void deadlines_push(int task) {
+  // Move the new task up until its parent is due no later than it is
+  int i = num_deadlines++;
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (tasks[deadlines[parent]]->deadline <= tasks[task]->deadline) break;
+    deadlines[i] = deadlines[parent];
+    i = parent;
+  }
+  deadlines[i] = task;
+}
+
+/**
+ * Remove the task with the earliest deadline from the heap of deadlines.
+ *
+ * \returns the removed task
+ */
+int deadlines_pop() {
+  int first = deadlines[0];
+  int last = deadlines[--num_deadlines];
+
+  // Move the last task down from the root until both children are due no earlier than it is
+  int i = 0;
+  while (2 * i + 1 < num_deadlines) {
+    int child = 2 * i + 1;
+    if (child + 1 < num_deadlines &&
+        tasks[deadlines[child + 1]]->deadline < tasks[deadlines[child]]->deadline) {
+      child++;
+    }
+    if (tasks[last]->deadline <= tasks[deadlines[child]]->deadline) break;
+    deadlines[i] = deadlines[child];
+    i = child;
+  }
+  deadlines[i] = last;
+  return first;
+}
+
+/**
+ * Put a ready task in line to run: a deadline task in the heap of deadlines, and any other task
+ * at the back of the queue for its priority.
+ *
+ * \param task  A task in state 'R' that is not on any list
+ */
+void ready_push(int task) {
+  if (tasks[task]->relative_deadline > 0) {
+    tasks[task]->deadline = scheduler_time_ms() + tasks[task]->relative_deadline;
+    deadlines_push(task);
+  } else {
+    // A level that was empty starts waiting from scratch
+    int level = tasks[task]->priority;
+    if ((ready_levels & (1u << level)) == 0) skipped[level] = 0;
+    list_push(&ready[level], task);
+    ready_levels |= 1u << level;
+  }
+  num_ready++;
+}
+
+/**
+ * Find the priority level with ready tasks that has been passed over the most times, counting
+ * only levels passed over at least AGING_PICKS times. Ties go to the higher priority.
+ *
+ * \returns the level, or -1 if no level has waited that long
+ */
+int aged_level() {
+  int aged = -1;
+  for (int p = 0; p < TASK_PRIORITIES; p++) {
+    if ((ready_levels & (1u << p)) && skipped[p] >= AGING_PICKS &&
+        (aged == -1 || skipped[p] > skipped[aged])) {
+      aged = p;
+    }
+  }
+  return aged;
+}
+
+/**
+ * Take the next task to run. Deadline tasks go first, earliest deadline first. Then the highest
+ * priority goes first. Picks of deadline tasks and higher-priority tasks both count against a
+ * waiting level, and a level that has been passed over AGING_PICKS times gets the next turn, even
+ * ahead of deadline tasks.
+ *
+ * \returns the task to run, which must exist
+ */
+int ready_pop() {
+  num_ready--;
+
+  // Serve the highest priority with a ready task. Nothing is waiting behind it unless other
+  // levels or deadline tasks are ready too.
+  int chosen = ready_levels == 0 ? -1 : __builtin_ctz(ready_levels);
+  if (num_deadlines > 0 || (ready_levels & (ready_levels - 1)) != 0) {
+    // Serve the level that has waited longest instead, if any has waited too long. Otherwise a
+    // deadline task goes first.
+    int aged = aged_level();
+    if (aged != -1) {
+      chosen = aged;
+    } else if (num_deadlines > 0) {
+      chosen = -1;
+    }
+
+    // Every other level with a ready task waited through this pick
+    for (int p = 0; p < TASK_PRIORITIES; p++) {
+      if (p != chosen && (ready_levels & (1u << p))) skipped[p]++;
+    }
+    if (chosen == -1) return deadlines_pop();
+  }
+  skipped[chosen] = 0;
+
+  int task = list_pop(&ready[chosen]);
+  if (ready[chosen].head == -1) {
+    ready_levels &= ~(1u << chosen);
+    skipped[chosen] = 0;
+  }
+  return task;
+}
+
+/**
+ * Mark a task ready and put it in line to run.
+ *
+ * \param task  A task that is not running and not on any list
+ */
+void make_ready(int task) {
+  if (accounting) {
+    size_t now = monotonic_ns();
+    tasks[task]->stats.blocked_ns += now - tasks[task]->state_since;
+    tasks[task]->state_since = now;
+    if (tracing) trace_record(now, 'R', task, -1, 0);
+  }
+  tasks[task]->state = 'R';
+  ready_push(task);
+}
+
+/// The running task cannot be preempted while this is above zero. The scheduler raises it while
+/// it changes its own state, so the timer signal never sees a half-updated task.
+volatile sig_atomic_t preempt_count = 0;
+
+/// Set when the quantum ran out while preemption was disabled
+volatile sig_atomic_t preempt_pending = 0;
+
+/// Set while preempt_handler starts a switch. The switch then runs in a signal handler, where
+/// ncurses and the reactor must not be called, so input and file descriptors are left for the
+/// next switch a task makes itself.
+volatile sig_atomic_t preempting = 0;
+
+/// Sleeping tasks, kept as a min-heap on wake_up_time so the next one to wake is sleepers[0].
+/// It has room for max_tasks entries.
+int* sleepers = NULL;
+int num_sleepers = 0;  //< The number of tasks in the sleepers heap
+
+/**
+ * Add a sleeping task to the heap of sleepers.
+ *
+ * \param task  A task whose wake_up_time is set
+ */
+void sleepers_push(int task) {
+  // Move the new task up until its parent wakes no later than it does
+  int i = num_sleepers++;
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (tasks[sleepers[parent]]->wake_up_time <= tasks[task]->wake_up_time) break;
+    sleepers[i] = sleepers[parent];
+    i = parent;
+  }
+  sleepers[i] = task;
+}
+
+/**
+ * Remove the task that wakes first from the heap of sleepers.
+ *
+ * \returns the removed task
+ */
+int sleepers_pop() {
+  int first = sleepers[0];
+  int last = sleepers[--num_sleepers];
+
+  // Move the last task down from the root until both children wake no earlier than it does
+  int i = 0;
+  while (2 * i + 1 < num_sleepers) {
+    int child = 2 * i + 1;
+    if (child + 1 < num_sleepers &&
+        tasks[sleepers[child + 1]]->wake_up_time < tasks[sleepers[child]]->wake_up_time) {
+      child++;
+    }
+    if (tasks[last]->wake_up_time <= tasks[sleepers[child]]->wake_up_time) break;
+    sleepers[i] = sleepers[child];
+    i = child;
+  }
+  sleepers[i] = last;
+  return first;
+}
+
+/**
+ * Watch a file descriptor for the events its waiting tasks want. Stdin is also watched for input
+ * while tasks are blocked in task_readchar.
+ *
+ * \param fd  The file descriptor whose waiters changed
+ */
+void reactor_update(int fd) {
+  int wanted = 0;
+  for (int t = fd_table[fd].tasks.head; t != -1; t = tasks[t]->next) {
+    wanted |= tasks[t]->fd_events;
+  }
+  if (fd == STDIN_FILENO && input.head != -1) wanted |= POLLIN;
+  if (wanted == fd_table[fd].registered) return;
+
+#ifdef __linux__
+  // The EPOLL event bits have the same values as the POLL ones
+  struct epoll_event event = {.events = wanted, .data.fd = fd};
+  int op = EPOLL_CTL_MOD;
+  if (wanted == 0) op = EPOLL_CTL_DEL;
+  if (fd_table[fd].registered == 0) op = EPOLL_CTL_ADD;
+  int rc = epoll_ctl(epoll_fd, op, fd, &event);
+
+  // A descriptor closed while it was watched drops out of epoll on its own, and a new descriptor
+  // may have its number by now. Then it is already removed, or a change has to add it again.
+  if (rc == -1 && op == EPOLL_CTL_DEL && (errno == EBADF || errno == ENOENT)) rc = 0;
+  if (rc == -1 && op == EPOLL_CTL_MOD && errno == ENOENT) {
+    rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+  }
+
+  if (rc == -1) {
+    // Regular files can't be watched, but they never block either. A closed descriptor will
+    // never be ready, so its waiters are woken with POLLNVAL like poll() would report.
+    if (errno != EPERM && errno != EBADF) {
+      perror("epoll_ctl failed");
+      exit(2);
+    }
+    int revents = errno == EBADF ? POLLNVAL : 0;
+    while (fd_table[fd].tasks.head != -1) {
+      int t = list_pop(&fd_table[fd].tasks);
+      tasks[t]->fd_revents = revents != 0 ? revents : tasks[t]->fd_events;
+      num_fd_waiters--;
+      // The task in task_wait_fd that is adding itself is still running. It sees it was taken off
+      // the list and returns without blocking, so it must not be queued as well.
+      if (tasks[t]->state != 'R') make_ready(t);
+    }
+    fd_table[fd].registered = 0;
+    return;
+  }
+#endif
+
+  fd_table[fd].registered = wanted;
+}
+
+/**
+ * Wake the tasks waiting on a file descriptor for events that are now ready.
+ *
+ * \param fd       The file descriptor
+ * \param revents  The poll events that are ready
+ */
+void reactor_dispatch(int fd, int revents) {
+  // Errors, hangups, and closed descriptors wake every waiter, whatever it was waiting for
+  task_list_t still_waiting = {-1, -1};
+  while (fd_table[fd].tasks.head != -1) {
+    int t = list_pop(&fd_table[fd].tasks);
+    int ready_events = revents & (tasks[t]->fd_events | POLLERR | POLLHUP | POLLNVAL);
+    if (ready_events != 0) {
+      tasks[t]->fd_revents = ready_events;
+      num_fd_waiters--;
+      make_ready(t);
+    } else {
+      list_push(&still_waiting, t);
+    }
+  }
+  fd_table[fd].tasks = still_waiting;
+  reactor_update(fd);
+}
+
+/**
+ * Wait for watched file descriptors to become ready, and wake the tasks waiting on them.
+ *
+ * \param timeout  The longest to wait in milliseconds, 0 to only check, or -1 for no limit
+ */
+void reactor_wait(int timeout) {
+#ifdef __linux__
+  struct epoll_event events[MAX_EVENTS];
+  int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+  if (n == -1 && errno != EINTR) {
+    perror("epoll_wait failed");
+    exit(2);
+  }
+  for (int i = 0; i < n; i++) {
+    reactor_dispatch(events[i].data.fd, events[i].events);
+  }
+#else
+  // Without epoll, poll every watched descriptor
+  struct pollfd pfds[MAX_EVENTS];
+  int n = 0;
+  for (int fd = 0; fd < fd_table_size && n < MAX_EVENTS; fd++) {
+    if (fd_table[fd].registered != 0) {
+      pfds[n].fd = fd;
+      pfds[n].events = fd_table[fd].registered;
+      n++;
+    }
+  }
+  if (poll(pfds, n, timeout) == -1 && errno != EINTR) {
+    perror("poll failed");
+    exit(2);
+  }
+  for (int i = 0; i < n; i++) {
+    if (pfds[i].revents != 0) reactor_dispatch(pfds[i].fd, pfds[i].revents);
+  }
+#endif
+}
+
+/**
+ * Block the whole process until the first sleeping task is due to wake up, or until a file
+ * descriptor a task is waiting on becomes ready. That includes input on stdin if any task is
+ * blocked in task_readchar.
+ */
+void scheduler_idle() {
+  // On the virtual clock, idle time passes instantly. Descriptors are still checked, but tasks
+  // waiting only on input or descriptors are polled rather than waited for.
+  if (virtual_clock) {
+    if (num_sleepers > 0) virtual_time = tasks[sleepers[0]]->wake_up_time;
+    if (num_fd_waiters > 0) reactor_wait(0);
+    return;
+  }
+
+  int timeout = -1;
+  if (num_sleepers > 0) {
+    size_t now = monotonic_ms();
+    size_t wake_up_time = tasks[sleepers[0]]->wake_up_time;
+    timeout = wake_up_time > now ? wake_up_time - now : 0;
+  }
+
+  if (num_fd_waiters == 0 && input.head == -1) {
+    if (num_sleepers > 0) sleep_until_ms(tasks[sleepers[0]]->wake_up_time);
+    return;
+  }
+
+  // If stdin can't be watched, keep checking it the way task_readchar does
+  if (input.head != -1 && !(fd_table[STDIN_FILENO].registered & POLLIN)) timeout = 0;
+
+  reactor_wait(timeout);
+}
+
+/**
+ * Claim a slot in the task table that has never been used, making the table bigger if it is full.
+ * The slot's task_info_t is allocated and zeroed.
+ *
+ * \returns the index of the new slot
+ */
+int task_slot_alloc() {
+  if (num_tasks == max_tasks) {
+    max_tasks = max_tasks == 0 ? INITIAL_TASKS : max_tasks * 2;
+    tasks = realloc(tasks, sizeof(task_info_t*) * max_tasks);
+    sleepers = realloc(sleepers, sizeof(int) * max_tasks);
+    deadlines = realloc(deadlines, sizeof(int) * max_tasks);
+    if (tasks == NULL || sleepers == NULL || deadlines == NULL) {
+      perror("realloc failed");
+      exit(2);
+    }
+  }
+
+  tasks[num_tasks] = calloc(1, sizeof(task_info_t));
+  if (tasks[num_tasks] == NULL) {
+    perror("calloc failed");
+    exit(2);
+  }
+  return num_tasks++;
+}
+
+/**
+ * Finish cleaning up after the last task that exited. A task can't free its own stack because it
+ * is still running on it when it switches away, so the next task to run does it instead.
+ */
+void task_reclaim() {
+  if (exited_task == -1) return;
+
+  stack_free(&tasks[exited_task]->stack);
+  tasks[exited_task]->stack.base = NULL;
+
+  // The slot can now be reused by task_create
+  list_push(&free_slots, exited_task);
+  exited_task = -1;
+}
+
+/**
+ * Run on the signal stack when a task faults. If the current task has a growable stack and ran
+ * into the reserved pages under it, grow the stack and let the faulting instruction run again.
+ * Otherwise, if the fault hit the guard page, say so, and put back the default action so the fault
+ * kills the program when the faulting instruction runs again.
+ */
+void overflow_handler(int signal, siginfo_t* info, void* ctx) {
+  task_stack_t* stack = &tasks[current_task]->stack;
+  uint8_t* addr = info->si_addr;
+  if (stack_grow(stack, addr)) return;
+  if (addr >= stack->base && addr < stack->low) {
+    // Only async-signal-safe calls are allowed here, so no printf
+    const char message[] = "Task overflowed its stack\n";
+    write(STDERR_FILENO, message, sizeof(message) - 1);
+  }
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(struct sigaction));
+  sa.sa_handler = SIG_DFL;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGSEGV, &sa, NULL);
+}
+
+/**
+ * Make sure fd_table has an entry for a file descriptor.
+ *
+ * \param fd  The file descriptor
+ */
+void fd_table_grow(int fd) {
+  if (fd < fd_table_size) return;
+
+  int size = fd_table_size == 0 ? 64 : fd_table_size;
+  while (size <= fd) size *= 2;
+  fd_table = realloc(fd_table, sizeof(fd_waiters_t) * size);
+  if (fd_table == NULL) {
+    perror("realloc failed");
+    exit(2);
+  }
+  for (int i = fd_table_size; i < size; i++) {
+    fd_table[i].tasks.head = -1;
+    fd_table[i].tasks.tail = -1;
+    fd_table[i].registered = 0;
+  }
+  fd_table_size = size;
+}
 
 /**
  * Initialize the scheduler. Programs should call this before calling any other
  * functiosn in this file.
  */
 void scheduler_init() {
-  // Initialize the state of the scheduler to 'R': ready
-  tasks[current_task].state = 'R';
+  // The program's original thread becomes the first task. Initialize its state to 'R': ready
+  current_task = task_slot_alloc();
+  tasks[current_task]->state = 'R';
+  tasks[current_task]->priority = TASK_PRIORITY_NORMAL;
+  for (int p = 0; p < TASK_PRIORITIES; p++) {
+    ready[p].head = -1;
+    ready[p].tail = -1;
+  }
+
+#ifdef __linux__
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd == -1) {
+    perror("epoll_create1 failed");
+    exit(2);
+  }
+#endif
+  fd_table_grow(STDIN_FILENO);
+
+  // Report tasks that run off the end of their stacks. The handler can't run on the stack that
+  // overflowed, so give it one of its own.
+  stack_t signal_stack;
+  signal_stack.ss_sp = malloc(SIGNAL_STACK_SIZE);
+  signal_stack.ss_size = SIGNAL_STACK_SIZE;
+  signal_stack.ss_flags = 0;
+  if (signal_stack.ss_sp == NULL) {
+    perror("malloc failed");
+    exit(2);
+  }
+  if (sigaltstack(&signal_stack, NULL) == -1) {
+    perror("sigaltstack failed");
+    exit(2);
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(struct sigaction));
+  sa.sa_sigaction = overflow_handler;
+  sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGSEGV, &sa, NULL) == -1) {
+    perror("sigaction failed");
+    exit(2);
+  }
 }
 
+/**
+ * Set the number of worker threads. This scheduler always runs tasks on one thread, so the
+ * setting is ignored.
+ */
+void scheduler_set_workers(size_t n) {}
+
 void switch_context() {
+  // Keep the timer signal out while the task states are being changed
+  preempt_count++;
+  bool check_io = !preempting;
+  preempting = 0;
+
   // store the current task to current_task_temp and update current_task to find the next available
   // one to run
   int current_task_temp = current_task;
+  char state = tasks[current_task_temp]->state;
+
+  // The task stops running now, even if the scheduler idles before the next one runs
+  size_t now = 0;
+  if (accounting) {
+    now = monotonic_ns();
+    tasks[current_task_temp]->stats.run_ns += now - tasks[current_task_temp]->state_since;
+    tasks[current_task_temp]->state_since = now;
+  }
+
+  // A task that is giving up the CPU without blocking goes to the back of the line
+  if (state == 'R') ready_push(current_task_temp);
 
   while (TRUE) {
-    current_task = (current_task + 1) % num_tasks;
-    // If Exited, skip it
-    if (tasks[current_task].state == 'E') continue;
-    // If Ready, switch to it
-    else if (tasks[current_task].state == 'R')
-      break;
-    // If sleep, check whether sleep time is over
-    else if (tasks[current_task].state == 'S') {
-      if (time_ms() >= tasks[current_task].wake_up_time) {
-        tasks[current_task].state = 'R';
-        break;
-      } else
-        continue;
-    }
-
-    // If waiting, check whether the task being waited for is finished
-    else if (tasks[current_task].state == 'W') {
-      if ((tasks[tasks[current_task].wait_task].state == 'R') ||
-          (tasks[tasks[current_task].wait_task].state == 'E')) {
-        tasks[current_task].state = 'R';
-        break;
-      } else
-        continue;
-    }
-
-    // If blocked, check whether there is a user input now. If so, store it.
-    else if (tasks[current_task].state == 'B') {
-      int user_input_new = getch();
+    // Wake every sleeping task whose time has come. Sleepers are only looked at here.
+    if (num_sleepers > 0) {
+      size_t now = scheduler_time_ms();
+      while (num_sleepers > 0 && tasks[sleepers[0]]->wake_up_time <= now) {
+        make_ready(sleepers_pop());
+      }
+    }
+
+    // Pick up any file descriptors that became ready while tasks were running
+    if (check_io && num_fd_waiters > 0) reactor_wait(0);
+
+    // If tasks are blocked on input, give the next character to the one that asked first. This
+    // asks ncurses rather than the reactor, since ncurses may have input buffered or pushed back.
+    if (check_io && input.head != -1) {
+      int user_input_new = input_read();
       if (user_input_new != ERR) {
-        tasks[current_task].state = 'R';
-        tasks[current_task].user_input = user_input_new;
-        break;
-      } else
-        continue;
+        tasks[input.head]->user_input = user_input_new;
+        make_ready(list_pop(&input));
+        reactor_update(STDIN_FILENO);
+      }
     }
+
+    if (num_ready > 0) break;
+
+    // Nothing can run, so sleep instead of spinning until a sleeper is due, input arrives, or a
+    // file descriptor becomes ready
+    scheduler_idle();
   }
 
-  if (swapcontext(&(tasks[current_task_temp].context), &(tasks[current_task].context)) < 0) {
-    perror("swapcontect failed!\n");
-    exit(2);
+  current_task = ready_pop();
+  num_switches++;
+
+  if (accounting) {
+    task_info_t* next = tasks[current_task];
+    now = monotonic_ns();
+    size_t latency = now - next->state_since;
+    next->stats.ready_ns += latency;
+    if (latency > next->stats.max_latency_ns) next->stats.max_latency_ns = latency;
+    next->stats.switches++;
+    next->state_since = now;
+    if (tracing) {
+      trace_record(now, 'S', current_task_temp, current_task, state);
+    }
+  }
+
+  // Each task keeps its own preemption depth across the switch
+  tasks[current_task_temp]->preempt_count = preempt_count;
+
+  context_switch(&tasks[current_task_temp]->context, &tasks[current_task]->context);
+
+  // This task was just switched back in, so it starts a fresh quantum
+  preempt_count = tasks[current_task]->preempt_count;
+  preempt_pending = 0;
+  task_reclaim();
+  preempt_count--;
+}
+
+/**
+ * Run when the preemption timer fires. If the running task can be preempted, switch to
+ * the next ready task. The preempted task stays ready and resumes here later. The switch skips
+ * input and file descriptors, since the interrupted task may be in the middle of anything.
+ */
+void preempt_handler(int signal) {
+  if (preempt_count > 0) {
+    preempt_pending = 1;
+    return;
   }
+
+  // Switching can clobber errno, which the interrupted code may be about to read. The signal is
+  // not blocked while the handler runs, so hold off another one until the switch is under way.
+  int saved_errno = errno;
+  preempt_count++;
+  preempting = 1;
+  switch_context();
+  preempt_count--;
+  errno = saved_errno;
 }
+
 /**
  * This function will execute when a task's function returns. This allows you
  * to update scheduler states and start another task. This function is run
- * because of how the contexts are set up in the task_create function.
+ * by task_start once the task function returns.
  */
 void task_exit() {
-  // Set the state to 'E' and switch to a new task.
-  tasks[current_task].state = 'E';
+  // Set the state to 'E', wake every task waiting for this one, and switch to a new task.
+  task_preempt_disable();
+  tasks[current_task]->state = 'E';
+  if (tracing) trace_record(monotonic_ns(), 'E', current_task, -1, 0);
+
+  // Measure the stack while it is still there, so task_stats can report it after the task exits
+  task_stack_t* stack = &tasks[current_task]->stack;
+  tasks[current_task]->stats.stack_size = stack->top - stack->low;
+  tasks[current_task]->stats.stack_used = stack_used(stack);
+  while (tasks[current_task]->waiters.head != -1) {
+    make_ready(list_pop(&tasks[current_task]->waiters));
+  }
+
+  // The next task to run frees this task's stack and slot
+  exited_task = current_task;
   switch_context();
 }
 
+/**
+ * Every task starts here. A new task is switched in from the middle of switch_context, so
+ * it has to start with preemption enabled before running the task function.
+ */
+void task_start() {
+  task_reclaim();
+  preempt_count = 0;
+  preempt_pending = 0;
+  task_info_t* self = tasks[current_task];
+  if (self->future != NULL) {
+    self->future->result = self->arg_fn(self->arg);
+    self->future->done = true;
+  } else {
+    self->fn();
+  }
+
+  // Every task leaves through the same exit path, still on its own stack
+  task_exit();
+}
+
 /**
  * Create a new task and add it to the scheduler.
  *
@@ -117,42 +847,106 @@ void task_exit() {
  * \param fn      The new task will run this function.
  */
 void task_create(task_t* handle, task_fn_t fn) {
-  // Claim an index for the new task
-  int index = num_tasks;
-  num_tasks++;
+  task_create_ex(handle, fn, NULL);
+}
 
-  // Set the task handle to this index, since task_t is just an int
-  *handle = index;
+/**
+ * Create a new task with a priority or a deadline and add it to the scheduler.
+ *
+ * \param handle  The handle for this task will be written to this location.
+ * \param fn      The new task will run this function.
+ * \param attr    How to schedule the task, or NULL to schedule it like task_create does
+ */
+void task_create_ex(task_t* handle, task_fn_t fn, const task_attr_t* attr) {
+  if (attr != NULL && (attr->priority < 0 || attr->priority >= TASK_PRIORITIES)) {
+    fprintf(stderr, "Invalid task priority %d\n", attr->priority);
+    exit(2);
+  }
 
-  // We're going to make two contexts: one to run the task, and one that runs at the end of the task
-  // so we can clean up. Start with the second
+  // Don't let the timer switch tasks while this one is half set up
+  task_preempt_disable();
 
-  // First, duplicate the current context as a starting point
-  getcontext(&tasks[index].exit_context);
+  // Claim an index for the new task, reusing the slot of an exited task if there is one. The
+  // slot's generation changes so handles to the exited task don't refer to the new one.
+  int index;
+  if (free_slots.head != -1) {
+    index = list_pop(&free_slots);
+    tasks[index]->generation++;
+  } else {
+    index = task_slot_alloc();
+  }
 
-  // Set up a stack for the exit context
-  tasks[index].exit_context.uc_stack.ss_sp = malloc(STACK_SIZE);
-  tasks[index].exit_context.uc_stack.ss_size = STACK_SIZE;
+  // Set the task handle to this slot and generation
+  handle->index = index;
+  handle->generation = tasks[index]->generation;
 
-  // Set up a context to run when the task function returns. This should call task_exit.
-  makecontext(&tasks[index].exit_context, task_exit, 0);
+  // Set up the task's running context. It starts in task_start, which calls the task function and
+  // then task_exit when the task function finishes.
+  tasks[index]->fn = fn;
+  tasks[index]->future = NULL;
+  task_stack_t* stack = &tasks[index]->stack;
+  if (attr == NULL || attr->stack_size == 0) {
+    stack_alloc(stack, STACK_SIZE, attr == NULL ? 0 : attr->stack_max);
+  } else {
+    stack_alloc(stack, attr->stack_size, attr->stack_max);
+  }
+  if (accounting) stack_paint(stack);
+  context_init(&tasks[index]->context, stack->low, stack->top - stack->low, task_start);
 
-  // Now we start with the task's actual running context
-  getcontext(&tasks[index].context);
+  // Nobody is waiting for the new task yet. Put it in the ready queue.
+  tasks[index]->waiters.head = -1;
+  tasks[index]->waiters.tail = -1;
+  memset(&tasks[index]->stats, 0, sizeof(task_stats_t));
+  tasks[index]->state_since = accounting ? monotonic_ns() : 0;
+  tasks[index]->priority = attr == NULL ? TASK_PRIORITY_NORMAL : attr->priority;
+  tasks[index]->relative_deadline = attr == NULL ? 0 : attr->deadline_ms;
+  make_ready(index);
 
-  // Allocate a stack for the new task and add it to the context
-  tasks[index].context.uc_stack.ss_sp = malloc(STACK_SIZE);
-  tasks[index].context.uc_stack.ss_size = STACK_SIZE;
+  task_preempt_enable();
+}
 
-  // Now set the uc_link field, which sets things up so our task will go to the exit context when
-  // the task function finishes
-  tasks[index].context.uc_link = &tasks[index].exit_context;
+/**
+ * Create a new task that runs a function with an argument, and keep its result in a future.
+ *
+ * \param future  The future for the task's result. The task's handle is written to future->task.
+ * \param fn      The new task will run this function.
+ * \param arg     The argument to pass to fn
+ */
+void task_create_arg(task_future_t* future, task_arg_fn_t fn, void* arg) {
+  // The new task can't start before its function is filled in while preemption is off
+  task_preempt_disable();
+  task_create(&future->task, NULL);
+  task_info_t* task = tasks[future->task.index];
+  task->arg_fn = fn;
+  task->arg = arg;
+  task->future = future;
+  future->result = NULL;
+  future->done = false;
+  task_preempt_enable();
+}
 
-  // Initialize the state of each new task to Ready
-  tasks[index].state = 'R';
+/**
+ * Wait for the task behind a future to finish and get its result.
+ *
+ * \param future  A future set up by task_create_arg
+ * \returns what the task's function returned
+ */
+void* task_join(task_future_t* future) {
+  task_wait(future->task);
+  return future->result;
+}
 
-  // And finally, set up the context to execute the task function
-  makecontext(&tasks[index].context, fn, 0);
+/**
+ * Wait for the tasks behind several futures to finish. Waiting on each in turn is enough, since
+ * a task that already finished doesn't block.
+ *
+ * \param futures  An array of futures set up by task_create_arg
+ * \param count    The number of futures in the array
+ */
+void task_await_all(task_future_t* futures, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    task_wait(futures[i].task);
+  }
 }
 
 /**
@@ -162,10 +956,17 @@ void task_create(task_t* handle, task_fn_t fn) {
  * \param handle  This is the handle produced by task_create
  */
 void task_wait(task_t handle) {
-  // set the state of this task to wait, store which task is being waited, and change to a new task.
-  tasks[current_task].state = 'W';
-  tasks[current_task].wait_task = handle;
-  switch_context();
+  // If the task has not exited, set the state of this task to wait, join the list of tasks waiting
+  // for it, and change to a new task. task_exit will make this task ready again.
+  // A handle whose generation doesn't match the slot's refers to a task that exited long ago.
+  task_preempt_disable();
+  task_info_t* task = tasks[handle.index];
+  if (task->generation == handle.generation && task->state != 'E') {
+    tasks[current_task]->state = 'W';
+    list_push(&task->waiters, current_task);
+    switch_context();
+  }
+  task_preempt_enable();
 }
 
 /**
@@ -177,9 +978,12 @@ void task_wait(task_t handle) {
  */
 void task_sleep(size_t ms) {
   // set the state of this task to sleep, store the wake up time, and change to a new task.
-  tasks[current_task].wake_up_time = time_ms() + ms;
-  tasks[current_task].state = 'S';
+  task_preempt_disable();
+  tasks[current_task]->wake_up_time = scheduler_time_ms() + ms;
+  tasks[current_task]->state = 'S';
+  sleepers_push(current_task);
   switch_context();
+  task_preempt_enable();
 }
 
 /**
@@ -193,14 +997,523 @@ int task_readchar() {
   //  if there is user input, return it.
   // Otherwise, set the state of this task to block, change to a new task, and return the user input
   // after this task is switched back in the future..
-  int ch_input = getch();
+  task_preempt_disable();
+  int ch_input = input_read();
   if (ch_input != ERR) {
-    tasks[current_task].state = 'R';
-    tasks[current_task].user_input = ch_input;
-    return ch_input;
+    tasks[current_task]->state = 'R';
+    tasks[current_task]->user_input = ch_input;
   } else {
-    tasks[current_task].state = 'B';
+    tasks[current_task]->state = 'B';
+    list_push(&input, current_task);
+    reactor_update(STDIN_FILENO);
     switch_context();
+    ch_input = tasks[current_task]->user_input;
+  }
+  task_preempt_enable();
+  return ch_input;
+}
+
+/**
+ * Block the current task until a file descriptor is ready for I/O. Other tasks run meanwhile,
+ * and the process sleeps in epoll_wait when there is nothing else to do.
+ *
+ * \param fd      The file descriptor to wait on
+ * \param events  The poll events to wait for, such as POLLIN or POLLOUT
+ * \returns the poll events that are ready, which may include POLLERR or POLLHUP
+ */
+int task_wait_fd(int fd, int events) {
+  task_preempt_disable();
+  fd_table_grow(fd);
+  tasks[current_task]->fd_events = events;
+  tasks[current_task]->fd_revents = 0;
+  list_push(&fd_table[fd].tasks, current_task);
+  num_fd_waiters++;
+  reactor_update(fd);
+
+  // If the descriptor can't be watched, reactor_update takes every waiter off its list and sets
+  // the events to report. This task hasn't blocked yet, so it just returns them.
+  if (fd_table[fd].tasks.head != -1) {
+    tasks[current_task]->state = 'F';
+    switch_context();
+  }
+  int revents = tasks[current_task]->fd_revents;
+  task_preempt_enable();
+  return revents;
+}
+
+/**
+ * Stop watching a file descriptor, and wake every task waiting on it with POLLNVAL. The
+ * descriptor may already be closed.
+ *
+ * \param fd  The file descriptor
+ */
+void task_cancel_fd(int fd) {
+  task_preempt_disable();
+  if (fd >= 0 && fd < fd_table_size) {
+    while (fd_table[fd].tasks.head != -1) {
+      int t = list_pop(&fd_table[fd].tasks);
+      tasks[t]->fd_revents = POLLNVAL;
+      num_fd_waiters--;
+      make_ready(t);
+    }
+
+    // This removes the registration, unless stdin is still watched for task_readchar
+    reactor_update(fd);
+  }
+  task_preempt_enable();
+}
+
+/**
+ * Give up the CPU to the other ready tasks. The current task stays ready and runs again once
+ * they have had a turn.
+ */
+void task_yield() {
+  task_preempt_disable();
+  switch_context();
+  task_preempt_enable();
+}
+
+/**
+ * Turn on preemption so a task that runs for a whole quantum without sleeping, waiting, or
+ * reading input is switched out for another ready task. The quantum counts CPU time, so the
+ * timer never fires while the process is idle. Preemption is off until this is called.
+ *
+ * \param ms  The length of the quantum in milliseconds, or 0 to turn preemption back off.
+ */
+void scheduler_set_quantum(size_t ms) {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(struct sigaction));
+  sa.sa_handler = preempt_handler;
+
+  // Context switches don't save the signal mask, so the handler must not leave the signal
+  // blocked for whichever task it switches to
+  sa.sa_flags = SA_RESTART | SA_NODEFER;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGVTALRM, &sa, NULL) == -1) {
+    perror("sigaction failed");
+    exit(2);
+  }
+
+  // An all-zero timer turns preemption off
+  struct itimerval timer;
+  timer.it_interval.tv_sec = ms / 1000;
+  timer.it_interval.tv_usec = (ms % 1000) * 1000;
+  timer.it_value = timer.it_interval;
+  if (setitimer(ITIMER_VIRTUAL, &timer, NULL) == -1) {
+    perror("setitimer failed");
+    exit(2);
+  }
+}
+
+/**
+ * Stop the current task from being preempted until a matching call to task_preempt_enable.
+ */
+void task_preempt_disable() {
+  preempt_count++;
+}
+
+/**
+ * Allow the current task to be preempted again, and give up the CPU if the quantum ran out
+ * while preemption was disabled.
+ */
+void task_preempt_enable() {
+  preempt_count--;
+  if (preempt_count == 0 && preempt_pending) {
+    preempt_pending = 0;
+    switch_context();
+  }
+}
+
+/**
+ * Block the current task on the queue of a mutex, condition variable, or channel until another
+ * task wakes it with queue_wake. Preemption must be disabled.
+ *
+ * \param queue  The queue to wait on
+ */
+void queue_block(task_queue_t* queue) {
+  tasks[current_task]->state = 'L';
+  list_push(queue, current_task);
+  switch_context();
+}
+
+/**
+ * Wake the task that has been blocked longest on a queue. Preemption must be disabled.
+ *
+ * \param queue  The queue to wake a task from
+ * \returns true if a task was woken, or false if the queue was empty
+ */
+bool queue_wake(task_queue_t* queue) {
+  if (queue->head == -1) return false;
+  make_ready(list_pop(queue));
+  return true;
+}
+
+/**
+ * Set up a mutex, which starts unlocked.
+ *
+ * \param mutex  The mutex to set up
+ */
+void task_mutex_init(task_mutex_t* mutex) {
+  mutex->locked = false;
+  mutex->waiters.head = -1;
+  mutex->waiters.tail = -1;
+}
+
+/**
+ * Lock a mutex, blocking this task until it is this task's turn if another task holds it.
+ *
+ * \param mutex  The mutex to lock
+ */
+void task_mutex_lock(task_mutex_t* mutex) {
+  task_preempt_disable();
+  if (mutex->locked) {
+    // task_mutex_unlock hands the mutex straight to the first waiter, so it stays locked
+    queue_block(&mutex->waiters);
+  } else {
+    mutex->locked = true;
+  }
+  task_preempt_enable();
+}
+
+/**
+ * Unlock a mutex, handing it to the next waiting task if there is one.
+ *
+ * \param mutex  The mutex to unlock
+ */
+void task_mutex_unlock(task_mutex_t* mutex) {
+  task_preempt_disable();
+  if (!queue_wake(&mutex->waiters)) mutex->locked = false;
+  task_preempt_enable();
+}
+
+/**
+ * Set up a condition variable with no waiters.
+ *
+ * \param cond  The condition variable to set up
+ */
+void task_cond_init(task_cond_t* cond) {
+  cond->waiters.head = -1;
+  cond->waiters.tail = -1;
+}
+
+/**
+ * Unlock a mutex and block until the condition variable is signaled, then lock the mutex again.
+ *
+ * \param cond   The condition variable to wait on
+ * \param mutex  A mutex the current task holds
+ */
+void task_cond_wait(task_cond_t* cond, task_mutex_t* mutex) {
+  task_preempt_disable();
+  task_mutex_unlock(mutex);
+  queue_block(&cond->waiters);
+  task_mutex_lock(mutex);
+  task_preempt_enable();
+}
+
+/**
+ * Wake the task that has waited longest on a condition variable, if any task is waiting.
+ *
+ * \param cond  The condition variable to signal
+ */
+void task_cond_signal(task_cond_t* cond) {
+  task_preempt_disable();
+  queue_wake(&cond->waiters);
+  task_preempt_enable();
+}
+
+/**
+ * Wake every task waiting on a condition variable.
+ *
+ * \param cond  The condition variable to signal
+ */
+void task_cond_broadcast(task_cond_t* cond) {
+  task_preempt_disable();
+  while (queue_wake(&cond->waiters)) {
+  }
+  task_preempt_enable();
+}
+
+/**
+ * Set up an empty channel.
+ *
+ * \param channel   The channel to set up
+ * \param capacity  The most items the channel can hold, which must be at least one
+ */
+void task_channel_init(task_channel_t* channel, size_t capacity) {
+  channel->items = malloc(sizeof(void*) * capacity);
+  if (channel->items == NULL) {
+    perror("malloc failed");
+    exit(2);
+  }
+  channel->capacity = capacity;
+  channel->head = 0;
+  channel->count = 0;
+  channel->closed = false;
+  channel->senders.head = -1;
+  channel->senders.tail = -1;
+  channel->receivers.head = -1;
+  channel->receivers.tail = -1;
+}
+
+/**
+ * Free the memory a channel uses.
+ *
+ * \param channel  The channel to free
+ */
+void task_channel_destroy(task_channel_t* channel) {
+  free(channel->items);
+  channel->items = NULL;
+}
+
+/**
+ * Add an item to a channel, blocking while the channel is full. Handing over an item only moves
+ * tasks between the scheduler's lists, so it never makes a system call.
+ *
+ * \param channel  The channel to send to
+ * \param item     The item to send
+ * \returns false if the channel was closed and the item was not sent, otherwise true
+ */
+bool task_channel_send(task_channel_t* channel, void* item) {
+  task_preempt_disable();
+
+  // A woken sender may find the channel full again if another task got there first
+  while (channel->count == channel->capacity && !channel->closed) {
+    queue_block(&channel->senders);
   }
-  return tasks[current_task].user_input;
+  if (channel->closed) {
+    task_preempt_enable();
+    return false;
+  }
+
+  channel->items[(channel->head + channel->count) % channel->capacity] = item;
+  channel->count++;
+  queue_wake(&channel->receivers);
+  task_preempt_enable();
+  return true;
+}
+
+/**
+ * Take the oldest item from a channel, blocking while the channel is empty.
+ *
+ * \param channel  The channel to receive from
+ * \param item     The item is written to this location
+ * \returns false once the channel is closed and every item has been received, otherwise true
+ */
+bool task_channel_receive(task_channel_t* channel, void** item) {
+  task_preempt_disable();
+  while (channel->count == 0 && !channel->closed) {
+    queue_block(&channel->receivers);
+  }
+  if (channel->count == 0) {
+    task_preempt_enable();
+    return false;
+  }
+
+  *item = channel->items[channel->head];
+  channel->head = (channel->head + 1) % channel->capacity;
+  channel->count--;
+  queue_wake(&channel->senders);
+  task_preempt_enable();
+  return true;
+}
+
+/**
+ * Close a channel and wake every task blocked on it.
+ *
+ * \param channel  The channel to close
+ */
+void task_channel_close(task_channel_t* channel) {
+  task_preempt_disable();
+  channel->closed = true;
+  while (queue_wake(&channel->senders)) {
+  }
+  while (queue_wake(&channel->receivers)) {
+  }
+  task_preempt_enable();
+}
+
+/**
+ * Turn per-task time accounting on or off.
+ *
+ * \param on  True to keep task_stats up to date
+ */
+void scheduler_set_accounting(bool on) {
+  task_preempt_disable();
+
+  // Every task starts counting from now, so time from before accounting was on isn't counted
+  if (on && !accounting) {
+    size_t now = monotonic_ns();
+    for (int i = 0; i < num_tasks; i++) {
+      tasks[i]->state_since = now;
+    }
+  }
+  accounting = on;
+  if (!on) tracing = false;
+  task_preempt_enable();
+}
+
+/**
+ * Get the time accounting for a task.
+ *
+ * \param handle  The handle produced by task_create
+ * \param stats   The counts are written to this location
+ * \returns false if the handle refers to a task whose slot has been reused, otherwise true
+ */
+bool task_stats(task_t handle, task_stats_t* stats) {
+  if (handle.index >= num_tasks || tasks[handle.index]->generation != handle.generation) {
+    return false;
+  }
+  task_preempt_disable();
+  *stats = tasks[handle.index]->stats;
+
+  // Include the time the running task has had since it was switched in
+  if (accounting && handle.index == current_task) {
+    stats->run_ns += monotonic_ns() - tasks[current_task]->state_since;
+  }
+
+  // An exited task's stack was measured on the way out. Measure the others now.
+  task_stack_t* stack = &tasks[handle.index]->stack;
+  if (tasks[handle.index]->state != 'E') {
+    stats->stack_size = stack->top - stack->low;
+    stats->stack_used = stack_used(stack);
+  }
+  task_preempt_enable();
+  return true;
+}
+
+/**
+ * Start recording scheduling events into a ring buffer.
+ *
+ * \param capacity  The number of events the ring buffer holds
+ */
+void scheduler_trace_start(size_t capacity) {
+  task_preempt_disable();
+  trace_events = realloc(trace_events, sizeof(trace_event_t) * capacity);
+  if (trace_events == NULL) {
+    perror("realloc failed");
+    exit(2);
+  }
+  trace_capacity = capacity;
+  trace_count = 0;
+  scheduler_set_accounting(true);
+  tracing = true;
+  task_preempt_enable();
+}
+
+/**
+ * Stop recording scheduling events.
+ */
+void scheduler_trace_stop() {
+  tracing = false;
+}
+
+/**
+ * Write one complete event, a span of time on a task's track, in the Chrome trace event format.
+ *
+ * \param file   The file to write to
+ * \param name   The name of the span
+ * \param task   The task whose track the span goes on
+ * \param start  When the span started, in nanoseconds since the trace started
+ * \param end    When the span ended, in nanoseconds since the trace started
+ */
+void trace_write_span(FILE* file, const char* name, int task, size_t start, size_t end) {
+  fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,", name, task);
+  fprintf(file, "\"ts\":%.3f,\"dur\":%.3f}", start / 1e3, (end - start) / 1e3);
+}
+
+/**
+ * Write the recorded events to a file in the Chrome trace event format.
+ *
+ * \param path  The file to write
+ */
+void scheduler_trace_export(const char* path) {
+  FILE* file = fopen(path, "w");
+  if (file == NULL) {
+    perror("fopen failed");
+    exit(2);
+  }
+
+  // When each task started running or became ready, or -1 if it isn't running or ready. Spans
+  // that started before the oldest event still in the ring buffer are left out.
+  size_t* running_since = malloc(sizeof(size_t) * num_tasks);
+  size_t* ready_since = malloc(sizeof(size_t) * num_tasks);
+  if (running_since == NULL || ready_since == NULL) {
+    perror("malloc failed");
+    exit(2);
+  }
+  for (int i = 0; i < num_tasks; i++) {
+    running_since[i] = -1;
+    ready_since[i] = -1;
+  }
+
+  // Name every task's track. Task 0 is the program's original thread.
+  fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+  for (int i = 0; i < num_tasks; i++) {
+    fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,", i == 0 ? "" : ",");
+    fprintf(file, "\"tid\":%d,\"args\":{\"name\":\"task %d\"}}", i, i);
+  }
+
+  size_t oldest = trace_count > trace_capacity ? trace_count - trace_capacity : 0;
+  size_t base = trace_count > 0 ? trace_events[oldest % trace_capacity].time : 0;
+  for (size_t i = oldest; i < trace_count; i++) {
+    trace_event_t* event = &trace_events[i % trace_capacity];
+    size_t time = event->time - base;
+    if (event->type == 'R') {
+      ready_since[event->task] = time;
+    } else if (event->type == 'E') {
+      fprintf(file, ",\n{\"name\":\"exit\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,");
+      fprintf(file, "\"tid\":%d,\"ts\":%.3f}", event->task, time / 1e3);
+    } else if (event->type == 'S') {
+      // The task switched out stops running, and waits in the ready queue if it is still ready
+      if (running_since[event->task] != (size_t)-1) {
+        trace_write_span(file, "running", event->task, running_since[event->task], time);
+      }
+      running_since[event->task] = -1;
+      if (event->state == 'R') ready_since[event->task] = time;
+
+      // The task switched in ends its wait in the ready queue and starts running
+      if (ready_since[event->next] != (size_t)-1 && ready_since[event->next] < time) {
+        trace_write_span(file, "ready", event->next, ready_since[event->next], time);
+      }
+      ready_since[event->next] = -1;
+      running_since[event->next] = time;
+    }
+  }
+  fprintf(file, "\n]}\n");
+
+  free(running_since);
+  free(ready_since);
+  if (fclose(file) == EOF) {
+    perror("fclose failed");
+    exit(2);
+  }
+}
+
+/**
+ * Run sleeping tasks on a virtual clock instead of real time.
+ *
+ * \param on  True to use the virtual clock, false to go back to real time
+ */
+void scheduler_set_virtual_clock(bool on) {
+  // The virtual clock starts from the real time, so sleepers already waiting stay in order
+  if (on && !virtual_clock) virtual_time = monotonic_ms();
+  virtual_clock = on;
+}
+
+/**
+ * Read user input from a function instead of ncurses.
+ *
+ * \param fn  The function to read keys from, or NULL to go back to getch
+ */
+void scheduler_set_input(input_fn_t fn) {
+  read_key = fn;
+}
+
+/**
+ * Get the number of context switches the scheduler has made.
+ *
+ * \returns the number of times a task has been switched in
+ */
+size_t scheduler_switch_count() {
+  return num_switches;
 }
@@ -1,14 +1,99 @@
 #ifndef SCHEDULER_H
 #define SCHEDULER_H
 
+#include <stdbool.h>
 #include <stddef.h>
 
 /// This is the type of a function run in a scheduler task
 typedef void (*task_fn_t)();
 
+/// This is the type of a function run by task_create_arg. It gets the argument given there, and
+/// what it returns becomes the result of the task's future.
+typedef void* (*task_arg_fn_t)(void* arg);
+
 /// Outside code should use values of type task_t to refer to specific tasks.
-/// These will just be an index in our large array of tasks.
-typedef int task_t;
+/// A handle names a slot in the scheduler's task table and which of the tasks that have used
+/// that slot it means, so a handle to an exited task never refers to a newer task in its slot.
+typedef struct task {
+  int index;            //< The task's slot in the task table
+  unsigned generation;  //< The number of earlier tasks that used the same slot
+} task_t;
+
+/// The result of a task created by task_create_arg. The future must stay where it is until the
+/// task has finished, since the task writes its result into it.
+typedef struct task_future {
+  task_t task;   //< The task computing the result
+  void* result;  //< What the task's function returned, once done is set
+  bool done;     //< Set once the task's function has returned
+} task_future_t;
+
+/// The number of priority levels. Ready tasks at a lower number run first.
+#define TASK_PRIORITIES 4
+
+/// Priority levels, from first to last
+#define TASK_PRIORITY_INTERACTIVE 0
+#define TASK_PRIORITY_HIGH 1
+#define TASK_PRIORITY_NORMAL 2
+#define TASK_PRIORITY_BACKGROUND 3
+
+/// How a task is scheduled and how much stack it gets, for task_create_ex
+typedef struct task_attr {
+  int priority;        //< One of the TASK_PRIORITY levels. Tasks made by task_create are NORMAL.
+  size_t deadline_ms;  //< If not zero, each time the task becomes ready it should run within this
+                       //< many milliseconds. These tasks run ahead of every priority level,
+                       //< earliest deadline first, except that a level that has waited through
+                       //< a few picks still gets its turn.
+  size_t stack_size;   //< The usable size of the task's stack in bytes, or 0 for the default
+  size_t stack_max;    //< If larger than the stack size, the stack grows on demand when the task
+                       //< runs off its end, up to this many bytes
+} task_attr_t;
+
+/// Time a task has spent in each state, kept while accounting is on, and how much stack it used.
+/// Times are in nanoseconds.
+typedef struct task_stats {
+  size_t run_ns;          //< Time spent running
+  size_t ready_ns;        //< Time spent ready to run but waiting for the CPU
+  size_t blocked_ns;      //< Time spent sleeping, waiting, or blocked
+  size_t switches;        //< The number of times the task was switched in
+  size_t max_latency_ns;  //< The longest the task was ready before it got the CPU
+  size_t stack_size;      //< The usable size of the task's stack in bytes, including any growth
+  size_t stack_used;      //< The most of its stack the task has used, in bytes. This is only
+                          //< measured for tasks created while accounting is on.
+} task_stats_t;
+
+/// Tasks blocked on a mutex, condition variable, or channel, in the order they blocked. The
+/// scheduler links the tasks together through its task table.
+typedef struct task_queue {
+  int head;  //< The slot index of the first blocked task, or -1 if there are none
+  int tail;  //< The slot index of the last blocked task, or -1 if there are none
+} task_queue_t;
+
+/// A lock that blocks only the task waiting for it, not the thread running the task
+typedef struct task_mutex {
+  bool locked;            //< True while some task holds the mutex
+  task_queue_t waiters;  //< Tasks waiting to lock the mutex
+} task_mutex_t;
+
+/// A condition variable tasks can wait on while holding a task_mutex_t
+typedef struct task_cond {
+  task_queue_t waiters;  //< Tasks waiting to be signaled
+} task_cond_t;
+
+/// A bounded first-in, first-out queue of pointers that any number of tasks can send to and
+/// receive from
+typedef struct task_channel {
+  void** items;            //< Room for capacity items, used as a ring buffer
+  size_t capacity;         //< The most items the channel holds before senders block
+  size_t head;             //< The position of the oldest item
+  size_t count;            //< The number of items in the channel
+  bool closed;             //< Set by task_channel_close
+  task_queue_t senders;    //< Tasks waiting for room in the channel
+  task_queue_t receivers;  //< Tasks waiting for an item
+} task_channel_t;
+
+/// Initial values for a mutex and a condition variable, for ones that aren't set up at run time
+#define TASK_MUTEX_INIT {false, {-1, -1}}
+#define TASK_COND_INIT {{-1, -1}}
 
 /**
  * Initialize the scheduler. Programs should call this before calling any other
@@ -16,6 +101,15 @@ typedef int task_t;
  */
 void scheduler_init();
 
+/**
+ * Set the number of worker threads that run tasks. Call this before scheduler_init. The
+ * multi-threaded scheduler in scheduler-mt.c starts one worker per CPU unless told otherwise.
+ * The single-threaded scheduler runs every task on the program's own thread and ignores this.
+ *
+ * \param n  The number of worker threads
+ */
+void scheduler_set_workers(size_t n);
+
 /**
  * Create a new task and add it to the scheduler.
  *
@@ -24,9 +118,47 @@ void scheduler_init();
  */
 void task_create(task_t* handle, task_fn_t fn);
 
+/**
+ * Create a new task with a priority, a deadline, or its own stack size and add it to the
+ * scheduler. A task waiting at a lower priority still runs after a bounded number of
+ * higher-priority or deadline tasks get a turn, so it never starves, even behind a deadline task
+ * that is always ready.
+ *
+ * \param handle  The handle for this task will be written to this location.
+ * \param fn      The new task will run this function.
+ * \param attr    How to schedule the task, or NULL to schedule it like task_create does
+ */
+void task_create_ex(task_t* handle, task_fn_t fn, const task_attr_t* attr);
+
+/**
+ * Create a new task that runs a function with an argument, and keep its result in a future.
+ *
+ * \param future  The future for the task's result. The task's handle is written to future->task.
+ * \param fn      The new task will run this function.
+ * \param arg     The argument to pass to fn
+ */
+void task_create_arg(task_future_t* future, task_arg_fn_t fn, void* arg);
+
+/**
+ * Wait for the task behind a future to finish and get its result.
+ *
+ * \param future  A future set up by task_create_arg
+ * \returns what the task's function returned
+ */
+void* task_join(task_future_t* future);
+
+/**
+ * Wait for the tasks behind several futures to finish. Their results are then in the futures.
+ *
+ * \param futures  An array of futures set up by task_create_arg
+ * \param count    The number of futures in the array
+ */
+void task_await_all(task_future_t* futures, size_t count);
+
 /**
  * Wait for a task to finish. If the task has not yet finished, the scheduler should
  * suspend this task and wake it up later when the task specified by handle has exited.
+ * Waiting for a task that exited long ago returns right away.
  *
  * \param handle  This is the handle produced by task_create
  */
@@ -50,4 +182,226 @@ void task_sleep(size_t ms);
  */
 int task_readchar();
 
+/**
+ * Block the current task until a file descriptor is ready for I/O. The scheduler runs other
+ * tasks meanwhile, and sleeps until the descriptor is ready if there is nothing else to run.
+ *
+ * \param fd      The file descriptor to wait on
+ * \param events  The poll events to wait for, such as POLLIN or POLLOUT from <poll.h>
+ * \returns the poll events that are ready, which may include POLLERR or POLLHUP
+ */
+int task_wait_fd(int fd, int events);
+
+/**
+ * Stop watching a file descriptor, and wake every task waiting on it with POLLNVAL. Call this
+ * before closing a descriptor tasks may be waiting on, so the waiters don't wait forever and a
+ * new descriptor that reuses the number doesn't inherit the old one's registration.
+ *
+ * \param fd  The file descriptor
+ */
+void task_cancel_fd(int fd);
+
+/**
+ * Give up the CPU to the other ready tasks. The current task stays ready and runs again once
+ * they have had a turn.
+ */
+void task_yield();
+
+/**
+ * Turn on preemption so a task that runs for a whole quantum without sleeping, waiting, or
+ * reading input is switched out for another ready task. The quantum counts CPU time, so the
+ * timer never fires while the process is idle. Preemption is off until this is called.
+ *
+ * Preempted code can be interrupted anywhere, so tasks must disable preemption around calls
+ * into code that is not reentrant, such as stdio and malloc. That includes every ncurses call,
+ * like mvaddch or refresh: wrap them in task_preempt_disable and task_preempt_enable.
+ *
+ * A preemption switch runs in a signal handler, so it does not read input or check file
+ * descriptors. Tasks blocked in task_readchar or task_wait_fd are woken at the next switch a task
+ * makes itself, by sleeping, waiting, reading input, or yielding.
+ *
+ * \param ms  The length of the quantum in milliseconds, or 0 to turn preemption back off.
+ */
+void scheduler_set_quantum(size_t ms);
+
+/**
+ * Stop the current task from being preempted until a matching call to task_preempt_enable.
+ * Calls can be nested. The task can still sleep, wait, or read input while preemption is off.
+ */
+void task_preempt_disable();
+
+/**
+ * Allow the current task to be preempted again. If the quantum ran out while preemption was
+ * disabled, the task gives up the CPU now.
+ */
+void task_preempt_enable();
+
+/// This is the type of a function that returns the next key of user input, or ERR if there is none
+typedef int (*input_fn_t)();
+
+/**
+ * Run sleeping tasks on a virtual clock instead of real time. The virtual clock only moves when
+ * no task is ready, and then it jumps straight to the first sleeper's wake up time, so programs
+ * that mostly sleep run as fast as they can compute. Call this before any task sleeps.
+ *
+ * \param on  True to use the virtual clock, false to go back to real time
+ */
+void scheduler_set_virtual_clock(bool on);
+
+/**
+ * Get the time on the scheduler's clock, which task_sleep measures against.
+ *
+ * \returns the time in milliseconds, from monotonic_ms() or the virtual clock
+ */
+size_t scheduler_time_ms();
+
+/**
+ * Read user input from a function instead of ncurses, such as one that plays back a script. The
+ * scheduler polls the function whenever it looks for input for task_readchar.
+ *
+ * \param fn  The function to read keys from, or NULL to go back to getch
+ */
+void scheduler_set_input(input_fn_t fn);
+
+/**
+ * Get the number of context switches the scheduler has made, for measuring throughput.
+ *
+ * \returns the number of times a task has been switched in
+ */
+size_t scheduler_switch_count();
+
+/**
+ * Turn per-task time accounting on or off. Accounting reads the clock on every switch, so it is
+ * off until this is called. Tasks created while it is on also have their stacks painted, so
+ * task_stats can report how deep they went.
+ *
+ * \param on  True to keep task_stats up to date
+ */
+void scheduler_set_accounting(bool on);
+
+/**
+ * Get the time accounting for a task. The counts start when the task is created or when
+ * accounting is turned on, and are kept until the task's slot is reused.
+ *
+ * \param handle  The handle produced by task_create
+ * \param stats   The counts are written to this location
+ * \returns false if the handle refers to a task whose slot has been reused, otherwise true
+ */
+bool task_stats(task_t handle, task_stats_t* stats);
+
+/**
+ * Start recording scheduling events into a ring buffer, keeping only the newest ones once it is
+ * full. Tracing turns accounting on as well. Starting again discards any earlier events.
+ *
+ * \param capacity  The number of events the ring buffer holds
+ */
+void scheduler_trace_start(size_t capacity);
+
+/**
+ * Stop recording scheduling events. The events recorded so far are kept for export.
+ */
+void scheduler_trace_stop();
+
+/**
+ * Write the recorded events to a file in the Chrome trace event format, which chrome://tracing
+ * and Perfetto can open. Each task is a track showing when it ran and how long it sat ready.
+ *
+ * \param path  The file to write
+ */
+void scheduler_trace_export(const char* path);
+
+/**
+ * Set up a mutex, which starts unlocked.
+ *
+ * \param mutex  The mutex to set up
+ */
+void task_mutex_init(task_mutex_t* mutex);
+
+/**
+ * Lock a mutex. If another task holds it, block this task until it is this task's turn. Tasks
+ * get the mutex in the order they asked for it.
+ *
+ * \param mutex  The mutex to lock
+ */
+void task_mutex_lock(task_mutex_t* mutex);
+
+/**
+ * Unlock a mutex the current task holds, handing it to the next waiting task if there is one.
+ *
+ * \param mutex  The mutex to unlock
+ */
+void task_mutex_unlock(task_mutex_t* mutex);
+
+/**
+ * Set up a condition variable with no waiters.
+ *
+ * \param cond  The condition variable to set up
+ */
+void task_cond_init(task_cond_t* cond);
+
+/**
+ * Unlock a mutex and block the current task until the condition variable is signaled, then lock
+ * the mutex again before returning. Other tasks may change things in between, so callers should
+ * check what they were waiting for again.
+ *
+ * \param cond   The condition variable to wait on
+ * \param mutex  A mutex the current task holds
+ */
+void task_cond_wait(task_cond_t* cond, task_mutex_t* mutex);
+
+/**
+ * Wake the task that has waited longest on a condition variable, if any task is waiting.
+ *
+ * \param cond  The condition variable to signal
+ */
+void task_cond_signal(task_cond_t* cond);
+
+/**
+ * Wake every task waiting on a condition variable.
+ *
+ * \param cond  The condition variable to signal
+ */
+void task_cond_broadcast(task_cond_t* cond);
+
+/**
+ * Set up an empty channel.
+ *
+ * \param channel   The channel to set up
+ * \param capacity  The most items the channel can hold, which must be at least one
+ */
+void task_channel_init(task_channel_t* channel, size_t capacity);
+
+/**
+ * Free the memory a channel uses. No task may be using the channel.
+ *
+ * \param channel  The channel to free
+ */
+void task_channel_destroy(task_channel_t* channel);
+
+/**
+ * Add an item to a channel, blocking the current task while the channel is full.
+ *
+ * \param channel  The channel to send to
+ * \param item     The item to send
+ * \returns false if the channel was closed and the item was not sent, otherwise true
+ */
+bool task_channel_send(task_channel_t* channel, void* item);
+
+/**
+ * Take the oldest item from a channel, blocking the current task while the channel is empty.
+ *
+ * \param channel  The channel to receive from
+ * \param item     The item is written to this location
+ * \returns false once the channel is closed and every item has been received, otherwise true
+ */
+bool task_channel_receive(task_channel_t* channel, void** item);
+
+/**
+ * Close a channel. Sends fail from now on, and receivers get the items that are left and then
+ * stop blocking. Every blocked task wakes up.
+ *
+ * \param channel  The channel to close
+ */
+void task_channel_close(task_channel_t* channel);
+
 #endif
@@ -0,0 +1,145 @@
+#define _GNU_SOURCE
+
+#include "stack.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// This is the most stacks of exited tasks that are kept around for new tasks to reuse. Pooled
+// stacks keep whatever pages they committed, so this also bounds the memory the pool can hold.
+#define STACK_POOL_SIZE 1024
+
+// Growable stacks grow by whole multiples of this many bytes, so a task that goes deep doesn't
+// fault on every page. It must be a multiple of the page size.
+#define STACK_GROW_SIZE (64 * 1024)
+
+// Painted stacks are filled with this byte
+#define STACK_PAINT 0xa5
+
+void* stack_pool[STACK_POOL_SIZE];  //< Lowest usable addresses of plain stacks of exited tasks
+int num_pooled_stacks = 0;          //< The number of stacks in the stack pool
+
+/**
+ * Get the size of the guard page below every stack.
+ *
+ * \returns the size in bytes
+ */
+size_t stack_guard_size() {
+  static size_t page_size = 0;
+  if (page_size == 0) page_size = sysconf(_SC_PAGESIZE);
+  return page_size;
+}
+
+/**
+ * Get a stack, reusing one from the stack pool if it is a plain STACK_SIZE stack and there is one
+ * in the pool.
+ *
+ * \param stack     The stack is described here
+ * \param size      The usable size of the stack in bytes, rounded up to whole pages
+ * \param max_size  If larger than size, the most the stack can grow to with stack_grow.
+ *                  Otherwise the stack can't grow.
+ */
+void stack_alloc(task_stack_t* stack, size_t size, size_t max_size) {
+  size_t guard = stack_guard_size();
+  size = (size + guard - 1) / guard * guard;
+  max_size = max_size < size ? size : (max_size + guard - 1) / guard * guard;
+  stack->painted = false;
+
+  if (size == STACK_SIZE && max_size == STACK_SIZE && num_pooled_stacks > 0) {
+    stack->low = stack_pool[--num_pooled_stacks];
+    stack->base = stack->low - guard;
+    stack->top = stack->low + STACK_SIZE;
+    return;
+  }
+
+  // Reserve the guard page and every page the stack could grow into, none of them usable yet.
+  // Nothing is committed until it is touched.
+  stack->base = mmap(NULL, guard + max_size, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (stack->base == MAP_FAILED) {
+    perror("mmap failed");
+    exit(2);
+  }
+
+  // Stacks grow down, so the usable part goes at the top and the guard at the lowest address
+  stack->top = stack->base + guard + max_size;
+  stack->low = stack->top - size;
+  if (mprotect(stack->low, size, PROT_READ | PROT_WRITE) == -1) {
+    perror("mprotect failed");
+    exit(2);
+  }
+}
+
+/**
+ * Give a stack back to the stack pool, or unmap it if it can't be pooled or the pool is full.
+ *
+ * \param stack  A stack set up by stack_alloc that nothing is running on
+ */
+void stack_free(task_stack_t* stack) {
+  bool plain = stack->top - stack->low == STACK_SIZE &&
+               stack->low - stack->base == stack_guard_size();
+  if (plain && num_pooled_stacks < STACK_POOL_SIZE) {
+    stack_pool[num_pooled_stacks++] = stack->low;
+  } else if (munmap(stack->base, stack->top - stack->base) == -1) {
+    perror("munmap failed");
+    exit(2);
+  }
+}
+
+/**
+ * Make more of a growable stack usable after a fault at an address in the reserved pages below
+ * it. This is called from a signal handler, so it only makes async-signal-safe calls.
+ *
+ * \param stack  The stack of the task that faulted
+ * \param addr   The address the task faulted at
+ * \returns true if the stack grew to cover addr, or false if addr is not in the stack's
+ *          reserved pages, which includes the guard page
+ */
+bool stack_grow(task_stack_t* stack, void* addr) {
+  uint8_t* fault = addr;
+  uint8_t* limit = stack->base + stack_guard_size();
+  if (stack->base == NULL || fault < limit || fault >= stack->low) return false;
+
+  // Grow to the next multiple of STACK_GROW_SIZE below the fault, but not into the guard page
+  size_t depth = stack->top - fault;
+  uint8_t* low = stack->top - (depth + STACK_GROW_SIZE - 1) / STACK_GROW_SIZE * STACK_GROW_SIZE;
+  if (low < limit) low = limit;
+  if (mprotect(low, stack->low - low, PROT_READ | PROT_WRITE) == -1) return false;
+
+  // New pages are zero, which stack_used would count as used
+  if (stack->painted) memset(low, STACK_PAINT, stack->low - low);
+  stack->low = low;
+  return true;
+}
+
+/**
+ * Fill the usable part of a stack with a pattern, so stack_used can tell which parts a task
+ * touched.
+ *
+ * \param stack  A stack that nothing is running on yet
+ */
+void stack_paint(task_stack_t* stack) {
+  memset(stack->low, STACK_PAINT, stack->top - stack->low);
+  stack->painted = true;
+}
+
+/**
+ * Measure the high-water mark of a painted stack.
+ *
+ * \param stack  A stack filled in by stack_paint
+ * \returns the most of the stack that has been used, in bytes, or 0 if the stack isn't painted
+ */
+size_t stack_used(task_stack_t* stack) {
+  if (!stack->painted) return 0;
+
+  // Stacks are page aligned, so they can be scanned a word at a time from the deep end
+  uint64_t pattern;
+  memset(&pattern, STACK_PAINT, sizeof(pattern));
+  uint64_t* word = (uint64_t*)stack->low;
+  while (word < (uint64_t*)stack->top && *word == pattern) word++;
+  return stack->top - (uint8_t*)word;
+}
@@ -0,0 +1,76 @@
+#ifndef STACK_H
+#define STACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// This is the usable size of each task stack unless a task asks for another. It is only reserved
+// up front. Pages are committed when the task first touches them, so a task that stays shallow
+// uses only a few of them.
+#define STACK_SIZE (256 * 1024)
+
+/// A task stack. The task runs from top down to low. A growable stack has reserved pages below
+/// low that become usable the first time the task touches them. Below everything is a guard page.
+typedef struct task_stack {
+  uint8_t* base;  //< The lowest address of the mapping, where the guard page starts
+  uint8_t* low;   //< The lowest usable address
+  uint8_t* top;   //< The address just past the highest usable byte
+  bool painted;   //< True if unused parts of the stack are filled in for stack_used to find
+} task_stack_t;
+
+/**
+ * Get a stack, reusing one from the stack pool if it is a plain STACK_SIZE stack and there is one
+ * in the pool. The page below the stack is a guard page, so running off the end of the stack
+ * faults instead of overwriting other memory.
+ *
+ * \param stack     The stack is described here
+ * \param size      The usable size of the stack in bytes, rounded up to whole pages
+ * \param max_size  If larger than size, the most the stack can grow to with stack_grow.
+ *                  Otherwise the stack can't grow.
+ */
+void stack_alloc(task_stack_t* stack, size_t size, size_t max_size);
+
+/**
+ * Give a stack back to the stack pool, or unmap it if it can't be pooled or the pool is full.
+ *
+ * \param stack  A stack set up by stack_alloc that nothing is running on
+ */
+void stack_free(task_stack_t* stack);
+
+/**
+ * Make more of a growable stack usable after a fault at an address in the reserved pages below
+ * it. This is called from a signal handler, so it only makes async-signal-safe calls.
+ *
+ * \param stack  The stack of the task that faulted
+ * \param addr   The address the task faulted at
+ * \returns true if the stack grew to cover addr, or false if addr is not in the stack's
+ *          reserved pages, which includes the guard page
+ */
+bool stack_grow(task_stack_t* stack, void* addr);
+
+/**
+ * Fill the usable part of a stack with a pattern, so stack_used can tell which parts a task
+ * touched. This commits every page of the stack.
+ *
+ * \param stack  A stack that nothing is running on yet
+ */
+void stack_paint(task_stack_t* stack);
+
+/**
+ * Measure the high-water mark of a painted stack by finding the deepest byte that no longer
+ * holds the pattern.
+ *
+ * \param stack  A stack filled in by stack_paint
+ * \returns the most of the stack that has been used, in bytes, or 0 if the stack isn't painted
+ */
+size_t stack_used(task_stack_t* stack);
+
+/**
+ * Get the size of the guard page below every stack.
+ *
+ * \returns the size in bytes
+ */
+size_t stack_guard_size();
+
+#endif
@@ -0,0 +1,67 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "scheduler.h"
+#include "util.h"
+
+// Keep the CPU busy for a while without giving it up
+void busy_ms(size_t ms) {
+  size_t end = monotonic_ms() + ms;
+  while (monotonic_ms() < end) {
+  }
+}
+
+void hog_fn() {
+  // Run for 50ms at a time, so the other task has to wait for its turn
+  for (int i = 0; i < 10; i++) {
+    busy_ms(50);
+    task_yield();
+  }
+}
+
+void ticker_fn() {
+  // Mostly sleep, and only run briefly when woken
+  for (int i = 0; i < 20; i++) {
+    task_sleep(20);
+    busy_ms(1);
+  }
+}
+
+// Print how a task spent its time
+void print_stats(const char* name, task_t task) {
+  task_stats_t stats;
+  if (!task_stats(task, &stats)) {
+    printf("%s: No stats\n", name);
+    return;
+  }
+  printf("%s: ran %.0fms, ready %.0fms, blocked %.0fms, %lu switches, max latency %.0fms\n", name,
+         stats.run_ns / 1e6, stats.ready_ns / 1e6, stats.blocked_ns / 1e6, stats.switches,
+         stats.max_latency_ns / 1e6);
+}
+
+int main(int argc, char** argv) {
+  scheduler_init();
+  scheduler_trace_start(1024);
+
+  printf("The hog runs 50ms at a time, so the ticker's wake-ups wait up to 50ms.\n");
+
+  task_t hog;
+  task_t ticker;
+  task_create(&hog, hog_fn);
+  task_create(&ticker, ticker_fn);
+  task_wait(hog);
+  task_wait(ticker);
+  scheduler_trace_stop();
+
+  print_stats("Hog", hog);
+  print_stats("Ticker", ticker);
+
+  // Write the trace if asked to, so it can be opened in Perfetto
+  if (argc == 2) {
+    scheduler_trace_export(argv[1]);
+    printf("Wrote trace to %s\n", argv[1]);
+  }
+  printf("All done!\n");
+  return 0;
+}
@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "scheduler.h"
+#include "util.h"
+
+// Keep the CPU busy for a while without giving it up
+void busy_ms(size_t ms) {
+  size_t end = monotonic_ms() + ms;
+  while (monotonic_ms() < end) {
+  }
+}
+
+void high_fn() {
+  for (int i = 0; i < 20; i++) {
+    printf("H");
+    task_yield();
+  }
+  printf("\nHigh: Finished.\n");
+}
+
+void background_fn() {
+  for (int i = 0; i < 3; i++) {
+    printf("b");
+    task_yield();
+  }
+  printf("\nBackground: Finished.\n");
+}
+
+void always_ready_fn() {
+  for (int i = 0; i < 40; i++) {
+    printf("D");
+    task_yield();
+  }
+  printf("\nAlways-ready deadline: Finished.\n");
+}
+
+void hog_fn() {
+  for (int i = 0; i < 20; i++) {
+    busy_ms(10);
+    task_yield();
+  }
+}
+
+void deadline_fn() {
+  // Sleep and then check how long it took to get the CPU back, with hogs running
+  size_t worst = 0;
+  for (int i = 0; i < 10; i++) {
+    size_t wake_up_time = monotonic_ms() + 15;
+    task_sleep(15);
+    size_t late = monotonic_ms() - wake_up_time;
+    if (late > worst) worst = late;
+  }
+  printf("Deadline: Worst wake-up delay was %lums behind 3 hogs (at most one 10ms slice).\n",
+         worst);
+}
+
+int main() {
+  scheduler_init();
+
+  // The background task still gets a turn every few picks, even though the high-priority task
+  // is always ready
+  printf("The background task (b) should get a turn after every 8 high-priority ones (H).\n");
+  task_attr_t high = {.priority = TASK_PRIORITY_HIGH};
+  task_attr_t background = {.priority = TASK_PRIORITY_BACKGROUND};
+  task_t tasks[2];
+  task_create_ex(&tasks[0], high_fn, &high);
+  task_create_ex(&tasks[1], background_fn, &background);
+  task_wait(tasks[0]);
+  task_wait(tasks[1]);
+
+  // Levels age through picks of deadline tasks too, so a deadline task that is always ready
+  // doesn't starve them
+  printf("The background task (b) should get a turn after every 8 deadline ones (D), and finish "
+         "first.\n");
+  task_attr_t always_ready = {.deadline_ms = 1};
+  task_create_ex(&tasks[0], always_ready_fn, &always_ready);
+  task_create_ex(&tasks[1], background_fn, &background);
+  task_wait(tasks[0]);
+  task_wait(tasks[1]);
+
+  // A deadline task jumps ahead of every ready hog when it wakes up
+  task_attr_t deadline = {.deadline_ms = 1};
+  task_t hogs[3];
+  task_t deadline_task;
+  for (int i = 0; i < 3; i++) {
+    task_create(&hogs[i], hog_fn);
+  }
+  task_create_ex(&deadline_task, deadline_fn, &deadline);
+  for (int i = 0; i < 3; i++) {
+    task_wait(hogs[i]);
+  }
+  task_wait(deadline_task);
+
+  printf("All done!\n");
+  return 0;
+}
@@ -0,0 +1,70 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "scheduler.h"
+
+// The numbers to add up, and how many parts to split them into
+#define NUM_VALUES 1000
+#define NUM_PARTS 8
+
+int values[NUM_VALUES];
+
+/// One part of the array for a task to add up
+typedef struct part {
+  int* start;
+  size_t length;
+} part_t;
+
+// Add up one part of the array, giving the other tasks a turn in the middle
+void* sum_fn(void* arg) {
+  part_t* part = arg;
+  long sum = 0;
+  for (size_t i = 0; i < part->length; i++) {
+    sum += part->start[i];
+    if (i == part->length / 2) task_yield();
+  }
+  return (void*)(intptr_t)sum;
+}
+
+// Compute a Fibonacci number by forking a task for one of the two halves
+void* fib_fn(void* arg) {
+  intptr_t n = (intptr_t)arg;
+  if (n < 2) return (void*)n;
+  task_future_t left;
+  task_create_arg(&left, fib_fn, (void*)(n - 1));
+  intptr_t right = (intptr_t)fib_fn((void*)(n - 2));
+  return (void*)((intptr_t)task_join(&left) + right);
+}
+
+int main() {
+  scheduler_init();
+
+  // Scatter the parts of the array to tasks, then gather their sums
+  for (int i = 0; i < NUM_VALUES; i++) {
+    values[i] = i + 1;
+  }
+  part_t parts[NUM_PARTS];
+  task_future_t futures[NUM_PARTS];
+  for (int i = 0; i < NUM_PARTS; i++) {
+    parts[i].start = values + i * (NUM_VALUES / NUM_PARTS);
+    parts[i].length = NUM_VALUES / NUM_PARTS;
+    task_create_arg(&futures[i], sum_fn, &parts[i]);
+  }
+  task_await_all(futures, NUM_PARTS);
+
+  long total = 0;
+  for (int i = 0; i < NUM_PARTS; i++) {
+    printf("Part %d: %ld\n", i, (long)(intptr_t)futures[i].result);
+    total += (intptr_t)futures[i].result;
+  }
+  printf("Total: %ld (expected %d)\n", total, NUM_VALUES * (NUM_VALUES + 1) / 2);
+
+  // Futures can be joined from inside other tasks too
+  task_future_t fib;
+  task_create_arg(&fib, fib_fn, (void*)20);
+  printf("fib(20) = %ld (expected 6765)\n", (long)(intptr_t)task_join(&fib));
+
+  printf("All done!\n");
+  return 0;
+}
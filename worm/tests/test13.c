@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "scheduler.h"
+
+// Recursion depth for the growable task. With 1KB frames this goes several megabytes deep.
+#define DEPTH 4000
+
+// Use about 1KB of stack per level, giving the other tasks a turn halfway down
+int recurse(int depth) {
+  volatile char frame[1024];
+  frame[0] = depth;
+  if (depth == DEPTH / 2) task_yield();
+  if (depth == DEPTH) return frame[0];
+  return recurse(depth + 1) + frame[0];
+}
+
+void deep_fn() {
+  printf("Deep task: recursing %d levels\n", DEPTH);
+  recurse(0);
+  printf("Deep task: back at the top\n");
+}
+
+void shallow_fn() {
+  volatile char buffer[4096];
+  memset((char*)buffer, 1, sizeof(buffer));
+  printf("Shallow task: used a 4KB buffer\n");
+}
+
+void plain_fn() {
+  printf("Plain task: running\n");
+}
+
+// Print a task's stack size and how much of it the task used
+void report(const char* name, task_t task) {
+  task_stats_t stats;
+  task_stats(task, &stats);
+  printf("%s: %zuKB stack, %zuKB used\n", name, stats.stack_size / 1024, stats.stack_used / 1024);
+}
+
+int main() {
+  scheduler_init();
+
+  // Stacks are only painted for tasks created while accounting is on
+  scheduler_set_accounting(true);
+
+  task_t deep;
+  task_t shallow;
+  task_t plain;
+
+  // The deep task starts with 64KB of stack, which grows on demand up to 16MB
+  task_attr_t deep_attr = {.priority = TASK_PRIORITY_NORMAL,
+                           .stack_size = 64 * 1024,
+                           .stack_max = 16 * 1024 * 1024};
+  task_attr_t shallow_attr = {.priority = TASK_PRIORITY_NORMAL, .stack_size = 16 * 1024};
+
+  task_create_ex(&deep, deep_fn, &deep_attr);
+  task_create_ex(&shallow, shallow_fn, &shallow_attr);
+  task_create(&plain, plain_fn);
+
+  task_wait(deep);
+  task_wait(shallow);
+  task_wait(plain);
+
+  report("Deep task", deep);
+  report("Shallow task", shallow);
+  report("Plain task", plain);
+
+  printf("All done!\n");
+  return 0;
+}
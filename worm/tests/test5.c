@@ -0,0 +1,85 @@
+#include <curses.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "scheduler.h"
+#include "util.h"
+
+// Set once the ticking task is done, so the spinning tasks can stop
+volatile bool done = false;
+
+// Set by the spinning tasks whenever they run. The other tasks clear it with preemption off right
+// before they call into the scheduler, so input read while it is set was read from the timer signal.
+volatile bool spinning = false;
+volatile bool read_in_signal = false;
+
+size_t start_time;
+
+void spin_fn() {
+  // Never sleep, wait, or read input. Only preemption lets the other tasks run.
+  while (!done) {
+    spinning = true;
+  }
+  task_preempt_disable();
+  spinning = false;
+}
+
+void tick_fn() {
+  printf("Task 3 will print every half second while tasks 1 and 2 spin.\n");
+  for (int i = 0; i < 5; i++) {
+    // printf is not reentrant, so keep the timer out while it runs
+    task_preempt_disable();
+    spinning = false;
+    printf("Task 3: Tick at %lums\n", time_ms() - start_time);
+    task_sleep(500);
+    task_preempt_enable();
+  }
+  printf("Task 3: Finished.\n");
+  done = true;
+  task_preempt_disable();
+  spinning = false;
+}
+
+// Stands in for ncurses, which must not be called from a signal handler. There is a key once the
+// ticks are done.
+int scripted_key() {
+  if (spinning) read_in_signal = true;
+  return done ? 'q' : ERR;
+}
+
+void reader_fn() {
+  task_preempt_disable();
+  spinning = false;
+  int key = task_readchar();
+  task_preempt_enable();
+  printf("Task 4: Read '%c'. Input was %sread from the timer signal.\n", key,
+         read_in_signal ? "" : "never ");
+}
+
+int main() {
+  scheduler_init();
+  scheduler_set_input(scripted_key);
+  scheduler_set_quantum(10);
+  start_time = time_ms();
+
+  task_t task1;
+  task_t task2;
+  task_t task3;
+  task_t task4;
+
+  task_create(&task1, spin_fn);
+  task_create(&task2, spin_fn);
+  task_create(&task3, tick_fn);
+  task_create(&task4, reader_fn);
+
+  task_wait(task1);
+  task_wait(task2);
+  task_wait(task3);
+  task_wait(task4);
+
+  printf("All done!\n");
+
+  return 0;
+}
@@ -0,0 +1,43 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "scheduler.h"
+
+#define ROUNDS 1000
+#define TASKS_PER_ROUND 300
+
+int finished = 0;
+
+void short_fn() {
+  // Give the other tasks in this round a turn before finishing
+  task_sleep(0);
+  finished++;
+}
+
+int main() {
+  scheduler_init();
+
+  printf("Running %d short tasks, %d at a time.\n", ROUNDS * TASKS_PER_ROUND, TASKS_PER_ROUND);
+
+  task_t first;
+  task_t handles[TASKS_PER_ROUND];
+  for (int round = 0; round < ROUNDS; round++) {
+    for (int i = 0; i < TASKS_PER_ROUND; i++) {
+      task_create(&handles[i], short_fn);
+    }
+    for (int i = 0; i < TASKS_PER_ROUND; i++) {
+      task_wait(handles[i]);
+    }
+    if (round == 0) first = handles[0];
+  }
+
+  // The first task's slot has been reused many times, but its old handle still means that task
+  task_wait(first);
+
+  printf("%d tasks finished.\n", finished);
+  printf("All done!\n");
+
+  return 0;
+}
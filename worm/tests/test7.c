@@ -0,0 +1,46 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "scheduler.h"
+
+// Never cleared, but the compiler can't tell, so it doesn't complain about endless recursion
+volatile bool keep_going = true;
+
+// Recurse until the stack runs out. The frame is big so the guard page is reached quickly.
+int recurse(int depth) {
+  if (!keep_going) return 0;
+  volatile char frame[1024];
+  frame[0] = depth;
+  return recurse(depth + 1) + frame[0];
+}
+
+void task1_fn() {
+  printf("Task 1: Sleeping for half a second\n");
+  task_sleep(500);
+  printf("Task 1: Woke up\n");
+}
+
+void task2_fn() {
+  printf("Task 2: Recursing forever. This should stop with a stack overflow report.\n");
+  fflush(stdout);
+  recurse(0);
+}
+
+int main() {
+  scheduler_init();
+
+  task_t task1;
+  task_t task2;
+
+  task_create(&task1, task1_fn);
+  task_create(&task2, task2_fn);
+
+  task_wait(task1);
+  task_wait(task2);
+
+  printf("All done!\n");
+
+  return 0;
+}
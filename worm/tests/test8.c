@@ -0,0 +1,133 @@
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "scheduler.h"
+#include "util.h"
+
+// The two ends of a pipe the tasks talk through
+int pipe_fds[2];
+
+size_t start_time;
+
+void reader_fn() {
+  printf("Task 1 will wait for messages on the pipe without spinning.\n");
+  while (1) {
+    int revents = task_wait_fd(pipe_fds[0], POLLIN);
+    char buffer[64];
+    ssize_t bytes = read(pipe_fds[0], buffer, sizeof(buffer) - 1);
+    if (bytes == -1) {
+      perror("read failed");
+      exit(2);
+    }
+    if (bytes == 0) {
+      printf("Task 1: Pipe closed (revents %#x) at %lums.\n", revents, time_ms() - start_time);
+      break;
+    }
+    buffer[bytes] = '\0';
+    printf("Task 1: Read \"%s\" at %lums.\n", buffer, time_ms() - start_time);
+  }
+  printf("Task 1: Finished.\n");
+}
+
+void writer_fn() {
+  for (int i = 0; i < 3; i++) {
+    task_sleep(300);
+    char message[32];
+    int length = snprintf(message, sizeof(message), "message %d", i);
+    if (task_wait_fd(pipe_fds[1], POLLOUT) & POLLOUT) {
+      if (write(pipe_fds[1], message, length) == -1) {
+        perror("write failed");
+        exit(2);
+      }
+    }
+  }
+  task_sleep(300);
+  close(pipe_fds[1]);
+  printf("Task 2: Finished.\n");
+}
+
+void canceled_fn() {
+  int revents = task_wait_fd(pipe_fds[0], POLLIN);
+  printf("Task 3: Wait was canceled (revents %#x, POLLNVAL is %#x).\n", revents, POLLNVAL);
+}
+
+void reused_fn() {
+  int revents = task_wait_fd(pipe_fds[0], POLLIN);
+  printf("Task 4: The reused descriptor is readable (revents %#x).\n", revents);
+}
+
+void file_fn() {
+  // Regular files are always ready, so waiting on one returns right away
+  FILE* file = tmpfile();
+  if (file == NULL) {
+    perror("tmpfile failed");
+    exit(2);
+  }
+  for (int i = 0; i < 3; i++) {
+    int revents = task_wait_fd(fileno(file), POLLIN);
+    printf("Task 5: The file is ready without blocking (revents %#x).\n", revents);
+  }
+  fclose(file);
+
+  // A descriptor that is already closed can never become ready
+  int fd = pipe_fds[0];
+  close(fd);
+  int revents = task_wait_fd(fd, POLLIN);
+  printf("Task 5: The closed descriptor is invalid (revents %#x).\n", revents);
+}
+
+// Make a new pipe, which reuses the descriptor numbers of the last one
+void open_pipe() {
+  if (pipe(pipe_fds) == -1) {
+    perror("pipe failed");
+    exit(2);
+  }
+}
+
+int main() {
+  scheduler_init();
+  start_time = time_ms();
+  open_pipe();
+
+  task_t task1;
+  task_t task2;
+
+  task_create(&task1, reader_fn);
+  task_create(&task2, writer_fn);
+
+  task_wait(task1);
+  task_wait(task2);
+  close(pipe_fds[0]);
+
+  // Close a descriptor while a task waits on it, then wait on a new one with the same number
+  open_pipe();
+  task_t task3;
+  task_create(&task3, canceled_fn);
+  task_yield();
+  task_cancel_fd(pipe_fds[0]);
+  close(pipe_fds[0]);
+  close(pipe_fds[1]);
+  task_wait(task3);
+
+  open_pipe();
+  task_t task4;
+  task_create(&task4, reused_fn);
+  task_yield();
+  if (write(pipe_fds[1], "x", 1) == -1) {
+    perror("write failed");
+    exit(2);
+  }
+  task_wait(task4);
+
+  // Wait on descriptors that epoll can't watch while this task waits for the one doing it
+  task_t task5;
+  task_create(&task5, file_fn);
+  task_wait(task5);
+  close(pipe_fds[1]);
+
+  printf("All tasks finished. Took %lu ms of CPU time.\n", clock() * 1000 / CLOCKS_PER_SEC);
+  return 0;
+}
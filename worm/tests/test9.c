@@ -0,0 +1,110 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "scheduler.h"
+
+// The number of values sent down the pipeline
+#define NUM_VALUES 100
+
+// The number of times each counting task adds to the shared counter
+#define NUM_INCREMENTS 1000
+
+task_channel_t numbers;
+task_channel_t squares;
+
+task_mutex_t counter_lock = TASK_MUTEX_INIT;
+task_cond_t counter_done = TASK_COND_INIT;
+int counter = 0;
+
+void producer_fn() {
+  for (intptr_t i = 1; i <= NUM_VALUES; i++) {
+    task_channel_send(&numbers, (void*)i);
+  }
+  task_channel_close(&numbers);
+  printf("Producer: Sent %d numbers.\n", NUM_VALUES);
+}
+
+void squarer_fn() {
+  void* item;
+  int count = 0;
+  while (task_channel_receive(&numbers, &item)) {
+    intptr_t n = (intptr_t)item;
+    task_channel_send(&squares, (void*)(n * n));
+    count++;
+
+    // Let the other squarer take a turn, or this one would get every number
+    task_yield();
+  }
+  printf("Squarer: Squared %d numbers.\n", count);
+}
+
+void consumer_fn() {
+  void* item;
+  long sum = 0;
+  while (task_channel_receive(&squares, &item)) {
+    sum += (intptr_t)item;
+  }
+  printf("Consumer: Sum of squares is %ld (expected %d).\n", sum,
+         NUM_VALUES * (NUM_VALUES + 1) * (2 * NUM_VALUES + 1) / 6);
+}
+
+void counter_fn() {
+  for (int i = 0; i < NUM_INCREMENTS; i++) {
+    task_mutex_lock(&counter_lock);
+
+    // Give the other tasks a chance to run in the middle of the update. The mutex keeps them out.
+    int value = counter;
+    task_yield();
+    counter = value + 1;
+
+    if (counter == 3 * NUM_INCREMENTS) task_cond_signal(&counter_done);
+    task_mutex_unlock(&counter_lock);
+  }
+}
+
+void watcher_fn() {
+  task_mutex_lock(&counter_lock);
+  while (counter < 3 * NUM_INCREMENTS) {
+    task_cond_wait(&counter_done, &counter_lock);
+  }
+  printf("Watcher: Counter reached %d (expected %d).\n", counter, 3 * NUM_INCREMENTS);
+  task_mutex_unlock(&counter_lock);
+}
+
+int main() {
+  scheduler_init();
+  task_channel_init(&numbers, 4);
+  task_channel_init(&squares, 4);
+
+  // Send numbers through two squaring tasks and add up what comes out
+  task_t producer;
+  task_t squarers[2];
+  task_t consumer;
+  task_create(&producer, producer_fn);
+  task_create(&squarers[0], squarer_fn);
+  task_create(&squarers[1], squarer_fn);
+  task_create(&consumer, consumer_fn);
+  task_wait(producer);
+  task_wait(squarers[0]);
+  task_wait(squarers[1]);
+  task_channel_close(&squares);
+  task_wait(consumer);
+
+  // Have three tasks update a counter under a mutex while another waits for them to finish
+  task_t watcher;
+  task_t counters[3];
+  task_create(&watcher, watcher_fn);
+  for (int i = 0; i < 3; i++) {
+    task_create(&counters[i], counter_fn);
+  }
+  task_wait(watcher);
+  for (int i = 0; i < 3; i++) {
+    task_wait(counters[i]);
+  }
+
+  task_channel_destroy(&numbers);
+  task_channel_destroy(&squares);
+  printf("All done!\n");
+  return 0;
+}
@@ -34,3 +34,43 @@ size_t time_ms() {
   // Convert timeval values to milliseconds
   return tv.tv_sec * 1000 + tv.tv_usec / 1000;
 }
+
+/**
+ * Get the time in milliseconds from a clock that never jumps, for measuring intervals
+ */
+size_t monotonic_ms() {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+    perror("clock_gettime");
+    exit(2);
+  }
+
+  // Convert timespec values to milliseconds
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Get the time in nanoseconds from the same clock as monotonic_ms()
+ */
+size_t monotonic_ns() {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+    perror("clock_gettime");
+    exit(2);
+  }
+  return ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Sleep until monotonic_ms() reaches a given time
+ * \param   time  The time to wake up, as returned by monotonic_ms()
+ */
+void sleep_until_ms(size_t time) {
+  struct timespec ts;
+  ts.tv_sec = time / 1000;
+  ts.tv_nsec = (time % 1000) * 1000000;
+
+  // Sleep repeatedly as long as clock_nanosleep is interrupted
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) {
+  }
+}
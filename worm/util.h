@@ -10,4 +10,13 @@ void sleep_ms(size_t ms);
 // Get the time in milliseconds since UNIX epoch
 size_t time_ms();
 
+// Get the time in milliseconds from a clock that never jumps, for measuring intervals
+size_t monotonic_ms();
+
+// Get the time in nanoseconds from the same clock as monotonic_ms()
+size_t monotonic_ns();
+
+// Sleep until monotonic_ms() reaches a given time
+void sleep_until_ms(size_t time);
+
 #endif
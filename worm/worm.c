@@ -22,20 +22,63 @@
 #define WORM_HORIZONTAL_INTERVAL 200
 #define WORM_VERTICAL_INTERVAL 300
 #define DRAW_BOARD_INTERVAL 33
+#define DRAW_BOARD_DEADLINE 5
 #define APPLE_UPDATE_INTERVAL 120
 #define READ_INPUT_INTERVAL 150
 #define GENERATE_APPLE_INTERVAL 2000
 #define BOARD_WIDTH 50
 #define BOARD_HEIGHT 25
+#define BOARD_CELLS (BOARD_WIDTH * BOARD_HEIGHT)
+
+// The number of scheduling events kept when the game is traced
+#define TRACE_EVENTS 65536
+
+// Headless parameters: how many games to play by default, and how long each one lasts on the
+// virtual clock before the autopilot quits
+#define HEADLESS_GAMES 100
+#define HEADLESS_GAME_LENGTH 60000
+
+#ifdef HEADLESS
+// There is no terminal, so drawing does nothing. The game still works out what it would draw.
+#undef mvaddch
+#undef mvprintw
+#undef refresh
+#undef ungetch
+#define mvaddch(row, col, ch) ((void)(ch))
+#define mvprintw(row, col, ...) ((void)0)
+#define refresh() ((void)0)
+#define ungetch(ch) (pending_key = (ch))
+#endif
 
 /**
  * In-memory representation of the game board
  * Zero represents an empty cell
- * Positive numbers represent worm cells (which count up at each time step until they reach
- * worm_length) Negative numbers represent apple cells (which count up at each time step)
+ * Positive numbers represent worm cells
+ * Negative numbers represent apple cells (which count up at each time step)
+ * Change cells with set_cell, so they get redrawn.
  */
 int board[BOARD_HEIGHT][BOARD_WIDTH];
 
+/// A position on the board
+typedef struct cell {
+  int row;
+  int col;
+} cell_t;
+
+// The worm's segments, from the tail to the head, in a ring buffer
+cell_t segments[BOARD_CELLS];
+int segments_start = 0;  // The index of the tail
+int num_segments = 0;
+
+// Every apple on the board
+cell_t apples[BOARD_CELLS];
+int num_apples = 0;
+
+// Cells that changed since they were last drawn, and a flag per cell so each is listed once
+cell_t dirty_cells[BOARD_CELLS];
+int num_dirty = 0;
+bool dirty[BOARD_HEIGHT][BOARD_WIDTH];
+
 // Worm parameters
 int worm_dir = DIR_NORTH;
 int worm_length = INIT_WORM_LENGTH;
@@ -46,6 +89,22 @@ int apple_age = 120;
 // Is the game running?
 bool running = true;
 
+// The number of times the worm has moved, over every game played
+size_t ticks = 0;
+
+// A key for the headless autopilot to hand out before anything else, like ungetch
+int pending_key = ERR;
+
+// When the current game started, in scheduler_time_ms() time
+size_t game_start_time;
+
+// Thread handles for each of the game threads
+task_t update_worm_thread;
+task_t draw_board_thread;
+task_t read_input_thread;
+task_t update_apples_thread;
+task_t generate_apple_thread;
+
 /**
  * Convert a board row number to a screen position
  * \param   row   The board row number to convert
@@ -64,6 +123,43 @@ int screen_col(int col) {
   return 2 + col;
 }
 
+/**
+ * Change a board cell and remember to draw it again
+ * \param   row    The board row of the cell
+ * \param   col    The board column of the cell
+ * \param   value  The new value for the cell
+ */
+void set_cell(int row, int col, int value) {
+  board[row][col] = value;
+  if (!dirty[row][col]) {
+    dirty[row][col] = true;
+    dirty_cells[num_dirty].row = row;
+    dirty_cells[num_dirty].col = col;
+    num_dirty++;
+  }
+}
+
+/**
+ * Add a segment at the head of the worm
+ * \param   row   The board row of the new head
+ * \param   col   The board column of the new head
+ */
+void worm_push(int row, int col) {
+  cell_t* head = &segments[(segments_start + num_segments) % BOARD_CELLS];
+  head->row = row;
+  head->col = col;
+  num_segments++;
+  set_cell(row, col, 1);
+}
+
+/**
+ * Forget an apple, moving the last apple into its place in the list
+ * \param   i   The index of the apple in the apples list
+ */
+void apple_remove(int i) {
+  apples[i] = apples[--num_apples];
+}
+
 /**
  * Initialize the board display by printing the title and edges
  */
@@ -116,27 +212,35 @@ void end_game() {
  * Run in a thread to draw the current state of the game board.
  */
 void draw_board() {
+  int drawn_score = -1;
   while (running) {
-    // Loop over cells of the game board
-    for (int r = 0; r < BOARD_HEIGHT; r++) {
-      for (int c = 0; c < BOARD_WIDTH; c++) {
-        if (board[r][c] == 0) {  // Draw blank spaces
-          mvaddch(screen_row(r), screen_col(c), ' ');
-        } else if (board[r][c] > 0) {  // Draw worm
-          mvaddch(screen_row(r), screen_col(c), 'O');
-        } else {  // Draw apple spinner thing
-          char spinner_chars[] = {'|', '/', '-', '\\'};
-          mvaddch(screen_row(r), screen_col(c), spinner_chars[abs(board[r][c] % 4)]);
-        }
+    // Only draw the cells that changed since the last frame
+    for (int i = 0; i < num_dirty; i++) {
+      int r = dirty_cells[i].row;
+      int c = dirty_cells[i].col;
+      dirty[r][c] = false;
+      if (board[r][c] == 0) {  // Draw blank spaces
+        mvaddch(screen_row(r), screen_col(c), ' ');
+      } else if (board[r][c] > 0) {  // Draw worm
+        mvaddch(screen_row(r), screen_col(c), 'O');
+      } else {  // Draw apple spinner thing
+        char spinner_chars[] = {'|', '/', '-', '\\'};
+        mvaddch(screen_row(r), screen_col(c), spinner_chars[abs(board[r][c] % 4)]);
       }
     }
+    bool changed = num_dirty > 0;
+    num_dirty = 0;
+
+    // Draw the score if it changed
+    int score = worm_length - INIT_WORM_LENGTH;
+    if (score != drawn_score) {
+      mvprintw(screen_row(-2), screen_col(BOARD_WIDTH - 9), "Score %03d\r", score);
+      drawn_score = score;
+      changed = true;
+    }
 
-    // Draw the score
-    mvprintw(screen_row(-2), screen_col(BOARD_WIDTH - 9), "Score %03d\r",
-             worm_length - INIT_WORM_LENGTH);
-
-    // Refresh the display
-    refresh();
+    // Refresh the display if anything was drawn
+    if (changed) refresh();
 
     // Sleep for a while before drawing the board again
     task_sleep(DRAW_BOARD_INTERVAL);
@@ -177,27 +281,17 @@ void read_input() {
  */
 void update_worm() {
   while (running) {
-    int worm_row;
-    int worm_col;
-
-    // "Age" each existing segment of the worm
-    for (int r = 0; r < BOARD_HEIGHT; r++) {
-      for (int c = 0; c < BOARD_WIDTH; c++) {
-        if (board[r][c] == 1) {  // Found the head of the worm. Save position
-          worm_row = r;
-          worm_col = c;
-        }
-
-        // Add 1 to the age of the worm segment
-        if (board[r][c] > 0) {
-          board[r][c]++;
-
-          // Remove the worm segment if it is too old
-          if (board[r][c] > worm_length) {
-            board[r][c] = 0;
-          }
-        }
-      }
+    // Start from the head of the worm
+    cell_t* head = &segments[(segments_start + num_segments - 1) % BOARD_CELLS];
+    int worm_row = head->row;
+    int worm_col = head->col;
+
+    // Remove the tail so the worm is one short of its length, leaving room for the new head
+    while (num_segments >= worm_length) {
+      cell_t* tail = &segments[segments_start];
+      set_cell(tail->row, tail->col, 0);
+      segments_start = (segments_start + 1) % BOARD_CELLS;
+      num_segments--;
     }
 
     // Move the worm into a new space
@@ -228,10 +322,16 @@ void update_worm() {
       // Check for apple collisions
       // Worm gets longer
       worm_length++;
+
+      // The apple is gone
+      for (int i = 0; i < num_apples; i++) {
+        if (apples[i].row == worm_row && apples[i].col == worm_col) apple_remove(i);
+      }
     }
 
     // Add the worm's new position
-    if (running) board[worm_row][worm_col] = 1;
+    if (running) worm_push(worm_row, worm_col);
+    ticks++;
 
     // Update the worm movement speed to deal with rectangular cursors
     if (worm_dir == DIR_NORTH || worm_dir == DIR_SOUTH) {
@@ -248,11 +348,17 @@ void update_worm() {
 void update_apples() {
   while (running) {
     // "Age" each apple
-    for (int r = 0; r < BOARD_HEIGHT; r++) {
-      for (int c = 0; c < BOARD_WIDTH; c++) {
-        if (board[r][c] < 0) {  // Add one to each apple cell
-          board[r][c]++;
-        }
+    int i = 0;
+    while (i < num_apples) {
+      int r = apples[i].row;
+      int c = apples[i].col;
+      set_cell(r, c, board[r][c] + 1);
+
+      // Drop apples that ran out
+      if (board[r][c] == 0) {
+        apple_remove(i);
+      } else {
+        i++;
       }
     }
 
@@ -275,7 +381,10 @@ void generate_apple() {
       if (board[r][c] == 0) {
         // Pick a random age between apple_age/2 and apple_age*1.5
         // Negative numbers represent apples, so negate the whole value
-        board[r][c] = -((rand() % apple_age) + apple_age / 2);
+        set_cell(r, c, -((rand() % apple_age) + apple_age / 2));
+        apples[num_apples].row = r;
+        apples[num_apples].col = c;
+        num_apples++;
         inserted = true;
       }
     }
@@ -283,6 +392,124 @@ void generate_apple() {
   }
 }
 
+// Print how a task spent its time and how deep its stack went, if accounting was on
+void print_task_stats(const char* name, task_t task) {
+  task_stats_t stats;
+  if (!task_stats(task, &stats)) return;
+  fprintf(stderr, "%-15s %10.1f %10.1f %10.1f %9lu %10.2f %9.1f\n", name, stats.run_ns / 1e6,
+          stats.ready_ns / 1e6, stats.blocked_ns / 1e6, stats.switches,
+          stats.max_latency_ns / 1e6, stats.stack_used / 1024.0);
+}
+
+/**
+ * Put the game back to how it starts: an empty board with a short worm in the middle.
+ */
+void reset_game() {
+  // Zero out the board contents, and draw every cell in the first frame
+  for (int r = 0; r < BOARD_HEIGHT; r++) {
+    for (int c = 0; c < BOARD_WIDTH; c++) {
+      set_cell(r, c, 0);
+    }
+  }
+  num_segments = 0;
+  num_apples = 0;
+  worm_dir = DIR_NORTH;
+  worm_length = INIT_WORM_LENGTH;
+  running = true;
+
+  // Put the worm at the middle of the board
+  worm_push(BOARD_HEIGHT / 2, BOARD_WIDTH / 2);
+  game_start_time = scheduler_time_ms();
+}
+
+/**
+ * Run the game's tasks until the game ends.
+ * \param   wait_for_apples  Also wait for the generate_apple task, which can take a while to exit
+ */
+void play_game(bool wait_for_apples) {
+  // Create threads for each task in the game
+  // Frames should go out promptly and key presses should feel instant, while new apples can wait
+  task_attr_t draw_attr = {.deadline_ms = DRAW_BOARD_DEADLINE};
+  task_attr_t input_attr = {.priority = TASK_PRIORITY_INTERACTIVE};
+  task_attr_t worm_attr = {.priority = TASK_PRIORITY_HIGH};
+  task_attr_t apples_attr = {.priority = TASK_PRIORITY_NORMAL};
+  task_attr_t generate_attr = {.priority = TASK_PRIORITY_BACKGROUND};
+  task_create_ex(&update_worm_thread, update_worm, &worm_attr);
+  task_create_ex(&draw_board_thread, draw_board, &draw_attr);
+  task_create_ex(&read_input_thread, read_input, &input_attr);
+  task_create_ex(&update_apples_thread, update_apples, &apples_attr);
+  task_create_ex(&generate_apple_thread, generate_apple, &generate_attr);
+
+  // Wait for these threads to exit
+  task_wait(update_worm_thread);
+  task_wait(draw_board_thread);
+  task_wait(read_input_thread);
+  task_wait(update_apples_thread);
+  if (wait_for_apples) task_wait(generate_apple_thread);
+}
+
+#ifdef HEADLESS
+
+/**
+ * Play the game without a player: steer clockwise to stay off the walls, and quit once the game
+ * has lasted HEADLESS_GAME_LENGTH. The scheduler calls this instead of getch.
+ * \return        A key, or ERR if the autopilot has nothing to press
+ */
+int autopilot_key() {
+  if (pending_key != ERR) {
+    int key = pending_key;
+    pending_key = ERR;
+    return key;
+  }
+  if (scheduler_time_ms() - game_start_time >= HEADLESS_GAME_LENGTH) return 'q';
+
+  // Turn before the worm's next move would take it off the board
+  cell_t* head = &segments[(segments_start + num_segments - 1) % BOARD_CELLS];
+  if (worm_dir == DIR_NORTH && head->row == 0) return KEY_RIGHT;
+  if (worm_dir == DIR_EAST && head->col == BOARD_WIDTH - 1) return KEY_DOWN;
+  if (worm_dir == DIR_SOUTH && head->row == BOARD_HEIGHT - 1) return KEY_LEFT;
+  if (worm_dir == DIR_WEST && head->col == 0) return KEY_UP;
+  return ERR;
+}
+
+// Entry point: Play games on a virtual clock as fast as possible, and report how fast it went
+int main(int argc, char** argv) {
+  if (argc > 2) {
+    fprintf(stderr, "Usage: %s [games]\n", argv[0]);
+    exit(1);
+  }
+  int games = argc == 2 ? atoi(argv[1]) : HEADLESS_GAMES;
+
+  // Use a fixed seed so every run plays the same games
+  srand(1);
+
+  scheduler_init();
+  scheduler_set_virtual_clock(true);
+  scheduler_set_input(autopilot_key);
+
+  size_t start_ns = monotonic_ns();
+  size_t start_time = scheduler_time_ms();
+  size_t start_switches = scheduler_switch_count();
+  int total_score = 0;
+  for (int i = 0; i < games; i++) {
+    reset_game();
+    play_game(true);
+    total_score += worm_length - INIT_WORM_LENGTH;
+  }
+  double seconds = (monotonic_ns() - start_ns) / 1e9;
+  size_t game_ms = scheduler_time_ms() - start_time;
+  size_t switches = scheduler_switch_count() - start_switches;
+
+  printf("Played %d games, total score %d\n", games, total_score);
+  printf("Game time:  %10.1fs\n", game_ms / 1e3);
+  printf("Real time:  %10.3fs (%.0fx faster)\n", seconds, game_ms / 1e3 / seconds);
+  printf("Ticks:      %10lu (%.0f ticks/s)\n", ticks, ticks / seconds);
+  printf("Switches:   %10lu (%.0f switches/s)\n", switches, switches / seconds);
+  return 0;
+}
+
+#else
+
 // Entry point: Set up the game, create jobs, then run the scheduler
 int main(void) {
   // Initialize the ncurses window
@@ -302,38 +529,17 @@ int main(void) {
   // Initialize the game display
   init_display();
 
-  // Zero out the board contents
-  memset(board, 0, BOARD_WIDTH * BOARD_HEIGHT * sizeof(int));
-
-  // Put the worm at the middle of the board
-  board[BOARD_HEIGHT / 2][BOARD_WIDTH / 2] = 1;
-
-  // Thread handles for each of the game threads
-  task_t update_worm_thread;
-  task_t draw_board_thread;
-  task_t read_input_thread;
-  task_t update_apples_thread;
-  task_t generate_apple_thread;
-
   // Initialize the scheduler library
   scheduler_init();
+  reset_game();
 
-  // Create threads for each task in the game
-  task_create(&update_worm_thread, update_worm);
-  task_create(&draw_board_thread, draw_board);
-  task_create(&read_input_thread, read_input);
-  task_create(&update_apples_thread, update_apples);
-  task_create(&generate_apple_thread, generate_apple);
-
-  // Wait for these threads to exit
-  task_wait(update_worm_thread);
-  task_wait(draw_board_thread);
-  task_wait(read_input_thread);
-  task_wait(update_apples_thread);
+  // Record a scheduling trace if WORM_TRACE names a file to write it to
+  const char* trace_path = getenv("WORM_TRACE");
+  if (trace_path != NULL) scheduler_trace_start(TRACE_EVENTS);
 
   // Don't wait for the generate_apple task because it sleeps for 2 seconds,
   // which creates a noticeable delay when exiting.
-  // task_wait(generate_apple_thread);
+  play_game(false);
 
   // Display the end of game message and wait for user input
   end_game();
@@ -342,5 +548,19 @@ int main(void) {
   delwin(mainwin);
   endwin();
 
+  if (trace_path != NULL) {
+    scheduler_trace_stop();
+    scheduler_trace_export(trace_path);
+    fprintf(stderr, "%-15s %10s %10s %10s %9s %10s %9s\n", "task", "run ms", "ready ms",
+            "blocked ms", "switches", "max lat ms", "stack KB");
+    print_task_stats("update_worm", update_worm_thread);
+    print_task_stats("draw_board", draw_board_thread);
+    print_task_stats("read_input", read_input_thread);
+    print_task_stats("update_apples", update_apples_thread);
+    print_task_stats("generate_apple", generate_apple_thread);
+  }
+
   return 0;
 }
+
+#endif